@@ -1,4 +1,5 @@
 CC := gcc 
 CXX := g++
 
-CFLAGS := -g
+CFLAGS := -g -pthread
+LDLIBS := -luring
@@ -0,0 +1,23 @@
+#ifndef ARENA_H__
+#define ARENA_H__
+
+#include <stddef.h>
+
+typedef struct arena *Arena;
+
+// Hands out aligned spans of [offset, offset + size) of one Memory
+// context, so connections come and go without allocating (or exporting)
+// device memory again. Safe to share between threads.
+Arena arena_create(size_t offset, size_t size, size_t align);
+
+// Returns -1 when no free span is large enough.
+int arena_alloc(Arena , size_t len, size_t *offset);
+void arena_free(Arena , size_t offset, size_t len);
+
+size_t arena_get_free(Arena );
+
+void arena_destroy(Arena );
+
+char *arena_get_error(void);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef CLIENT_H__
+#define CLIENT_H__
+
+#include "memory_provider.h"
+#include "staging.h"
+#include "stats.h"
+#include "socket.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/socket.h>
+
+typedef struct client *Client;
+
+// Outcome of the MSG_ZEROCOPY sends of a run. The kernel may fall back to
+// copying a send (e.g. when the device can't scatter-gather), which it
+// reports per completion range.
+struct client_zerocopy {
+	size_t sends;
+	size_t zerocopied;
+	size_t copied;
+};
+
+Client client_setup(int sockfd, struct memory_provider *, Memory );
+
+void client_set_staging(Client , StagingPool );
+void client_set_profile(Client , struct socket_profile *);
+void client_set_zerocopy(Client , bool zerocopy);
+
+// Caps the send rate (bit/s, 0 for unlimited) and, for client_run_as_tcp(),
+// keeps resending the context for duration seconds instead of once.
+void client_set_pacing(Client , long long rate, int duration);
+
+// Zero keeps the default message size or number of round trips; the
+// duration of client_set_pacing() takes precedence over the latter.
+void client_set_pingpong(Client , size_t message_size, int iterations);
+
+int client_run_as_tcp(Client , struct sockaddr *, socklen_t );
+
+// Splits the context into nstream stripes sent over as many connections
+// in parallel; see stripe.h for what the server gets on each.
+int client_run_as_striped(Client , struct sockaddr *, socklen_t ,
+			  int nstream);
+
+// Sends with IORING_OP_SEND_ZC from the registered staging pool; the
+// zerocopy numbers count one per send.
+int client_run_as_uring(Client , struct sockaddr *, socklen_t );
+
+// Sends one message at a time and waits for the server's echo; see
+// server_run_as_pingpong().
+int client_run_as_pingpong(Client , struct sockaddr *, socklen_t );
+
+void client_get_rtt(Client , struct histogram *rtt_ns);
+
+void client_get_zerocopy(Client , struct client_zerocopy *);
+
+void client_cleanup(Client );
+
+char *client_get_error(void);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef COPY_ENGINE_H__
+#define COPY_ENGINE_H__
+
+#include "memory_provider.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct copy_engine *CopyEngine;
+
+// Names one submitted copy. Copies complete in submission order, so a
+// fence being done means every earlier one is, too.
+typedef uint64_t CopyFence;
+
+// Runs the provider's copies on a thread of its own, with up to depth of
+// them queued; submitting blocks while the queue is full. A depth of 0
+// copies synchronously within the submitting call.
+CopyEngine copy_engine_create(struct memory_provider *, Memory , int depth);
+
+// The source (or destination) must stay untouched until the fence is.
+CopyFence copy_engine_to(CopyEngine , void *src, size_t offset, size_t len);
+CopyFence copy_engine_from(CopyEngine , void *dst, size_t offset, size_t len);
+
+// Once a copy failed, every call below fails too.
+int copy_engine_poll(CopyEngine , CopyFence );	// 1 done, 0 pending
+int copy_engine_wait(CopyEngine , CopyFence );
+int copy_engine_wait_v(CopyEngine , const CopyFence *, int count);
+int copy_engine_drain(CopyEngine );
+
+void copy_engine_destroy(CopyEngine );
+
+char *copy_engine_get_error(void);
+
+#endif
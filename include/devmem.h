@@ -0,0 +1,15 @@
+#ifndef DEVMEM_H__
+#define DEVMEM_H__
+
+typedef struct devmem *Devmem;
+
+Devmem devmem_bind_rx(const char *ifname, int dmabuf_fd,
+		      int start_queue, int num_queues);
+
+unsigned int devmem_get_id(Devmem );
+
+void devmem_unbind(Devmem );
+
+char *devmem_get_error(void);
+
+#endif
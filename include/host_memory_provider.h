@@ -0,0 +1,25 @@
+#ifndef HOST_MEMORY_PROVIDER_H__
+#define HOST_MEMORY_PROVIDER_H__
+
+#include "memory_provider.h"
+#include "memory_vector.h"
+
+// Backs Memory with anonymous host mappings instead of VRAM, so every
+// mode runs (and gives a baseline) on a machine without a GPU. Like the
+// amdgpu provider, memcpy_to()/memcpy_from() return the bytes copied.
+extern struct memory_provider host_memory_provider;
+
+// The same, but always as if HOST_MEMORY_HUGETLB was set.
+extern struct memory_provider hugepage_memory_provider;
+
+#define HOST_MEMORY_HUGETLB	(1 << 0)	// MAP_HUGETLB, if reserved
+#define HOST_MEMORY_MLOCK	(1 << 1)	// keep the pages resident
+
+// Applies to subsequent alloc() calls of both.
+void host_memory_provider_set_flags(int flags);
+
+// Batched entry points for memory_memcpy_to_v()/memory_memcpy_from_v().
+int host_memory_memcpy_to_v(Memory , const struct memory_vec *, int count);
+int host_memory_memcpy_from_v(Memory , const struct memory_vec *, int count);
+
+#endif
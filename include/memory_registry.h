@@ -0,0 +1,31 @@
+#ifndef MEMORY_REGISTRY_H__
+#define MEMORY_REGISTRY_H__
+
+#include "memory_provider.h"
+#include "memory_vector.h"
+
+#include <stdbool.h>
+
+// Every memory provider this tree knows of, by the name it is selected
+// with. Providers without batched copies leave memcpy_*_v NULL.
+struct memory_registry_entry {
+	const char *name;
+	const char *description;
+	struct memory_provider *provider;
+
+	// whether Memory of it can be bound with server_bind_devmem()
+	bool dmabuf;
+
+	int (*memcpy_to_v)(Memory , const struct memory_vec *, int count);
+	int (*memcpy_from_v)(Memory , const struct memory_vec *, int count);
+};
+
+const struct memory_registry_entry *memory_registry_find(const char *name);
+const struct memory_registry_entry *memory_registry_lookup(
+	struct memory_provider *
+);
+
+// Iterates the entries: index 0, 1, ... until NULL.
+const struct memory_registry_entry *memory_registry_get(int index);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef MEMORY_VECTOR_H__
+#define MEMORY_VECTOR_H__
+
+#include "memory_provider.h"
+
+#include <stddef.h>
+
+// One piece of a scatter-gather copy: len bytes between ptr on the host
+// and offset within Memory.
+struct memory_vec {
+	size_t offset;
+	void *ptr;
+	size_t len;
+};
+
+// Copies every piece with one call into the provider where it has a
+// batched entry point, and one memcpy_to()/memcpy_from() per piece
+// otherwise. Returns 0, or -1 with the provider's get_error() set.
+int memory_memcpy_to_v(struct memory_provider *, Memory ,
+		       const struct memory_vec *, int count);
+int memory_memcpy_from_v(struct memory_provider *, Memory ,
+			 const struct memory_vec *, int count);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef PIPELINE_H__
+#define PIPELINE_H__
+
+#include "memory_provider.h"
+#include "staging.h"
+#include "ring.h"
+#include "stats.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct pipeline *Pipeline;
+
+Pipeline pipeline_create(struct memory_provider *, Memory ,
+			 StagingPool , int nbuffer);
+
+void *pipeline_acquire(Pipeline );
+int pipeline_submit(Pipeline , size_t offset, size_t len, Ring );
+// Hands a chunk acquired but not submitted back to the pool, so an idle
+// pipeline holds none.
+void pipeline_release(Pipeline );
+int pipeline_flush(Pipeline );
+
+// Reads [offset, offset + len) of device memory ahead of the caller.
+// pipeline_next() hands over the next chunk, which the caller returns
+// with staging_put(); it returns its length, 0 once everything was read
+// or -1 on failure.
+Pipeline pipeline_create_reader(struct memory_provider *, Memory ,
+				StagingPool , int nbuffer,
+				size_t offset, size_t len);
+ssize_t pipeline_next(Pipeline , void **chunk, size_t *offset);
+
+void pipeline_take_copy_ns(Pipeline , struct histogram *);
+
+size_t pipeline_get_bufsize(Pipeline );
+
+void pipeline_destroy(Pipeline );
+
+char *pipeline_get_error(void);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef RING_H__
+#define RING_H__
+
+#include <stddef.h>
+
+typedef struct ring *Ring;
+
+Ring ring_create(size_t base, size_t size);
+
+size_t ring_space(Ring , size_t *offset);
+void ring_reserve(Ring , size_t len);
+void ring_commit(Ring , size_t len);
+
+size_t ring_peek(Ring , size_t *offset);
+void ring_consume(Ring , size_t len);
+
+void ring_reset(Ring );
+
+// Points an idle ring at another span; it starts out empty.
+void ring_assign(Ring , size_t base, size_t size);
+
+void ring_destroy(Ring );
+
+char *ring_get_error(void);
+
+#endif
@@ -2,16 +2,79 @@
 #define SERVER_H__
 
 #include "memory_provider.h"
+#include "staging.h"
+#include "ring.h"
+#include "stats.h"
+#include "socket.h"
+#include "arena.h"
 
 #include <stdbool.h>
 #include <stddef.h>
 
+#define SERVER_SLICE_ALIGN	4096	// device pages
+
+// Staging chunks a server may hold while it waits for data: the dma mode
+// keeps this many for a whole client. Servers sharing a pool need at
+// least this many chunks each.
+#define SERVER_COPY_DEPTH	4
+
 typedef struct server *Server;
 
-Server server_setup(int sockfd, Memory );
+// Called on the receiving thread with the ring of a connection whose
+// data has landed in device memory. It may consume any part of it with
+// ring_peek()/ring_consume(); whatever is left stays and throttles the
+// sender once the ring is full.
+typedef void (*ServerConsumer)(Ring , Memory , void *arg);
+
+// Where a devmem frag landed: [offset, offset + len) of the Memory.
+struct server_frag {
+	size_t offset;
+	size_t len;
+};
+
+// Called in the dma mode with the devmem frags of one recvmsg(), in
+// stream order. Their payload is not copied anywhere: the NIC placed it
+// in device memory, and its buffers go back to the NIC only once this
+// returns.
+typedef void (*ServerFragConsumer)(const struct server_frag *, int count,
+				   Memory , void *arg);
+
+// Called with the numbers of a finished client ("client N"), of the last
+// report interval ("interval") and of the whole run ("total").
+typedef void (*ServerReport)(const char *label, const struct stats *,
+			     void *arg);
+
+Server server_setup(int sockfd, struct memory_provider *, Memory ,
+		    size_t offset, size_t size);
+
+void server_set_staging(Server , StagingPool );
+void server_set_profile(Server , struct socket_profile *);
+void server_set_busy_poll(Server , int usecs, int budget);
+void server_set_ring(Server , ServerConsumer , void *arg);
+void server_set_frag_consumer(Server , ServerFragConsumer , void *arg);
+void server_set_report(Server , ServerReport , void *arg, int interval);
+
+// Connections of the tcp and uring modes take a slice of device memory
+// (by default all of the server's part, so clients are served one at a
+// time; a smaller slice serves several at once) out of an arena over
+// that part, and hand it back once they close. Servers given the same
+// arena share it instead. A client sending more than its slice is
+// dropped. server_set_slice() fails unless the slice is a multiple of
+// SERVER_SLICE_ALIGN within the server's part.
+void server_set_arena(Server , Arena );
+int server_set_slice(Server , size_t slice);
+
+// dmabuf_offset is where the server's Memory starts within the dmabuf.
+int server_bind_devmem(Server , const char *ifname, int dmabuf_fd,
+		       size_t dmabuf_offset, int start_queue, int num_queues);
 
 int server_run_as_tcp(Server );
 int server_run_as_dma(Server );
+int server_run_as_uring(Server );
+int server_run_as_striped(Server );
+int server_run_as_pingpong(Server );
+
+void server_stop(Server );
 
 void server_cleanup(Server );
 
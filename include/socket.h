@@ -3,7 +3,31 @@
 
 #include <stdbool.h>
 
+// Zero (or NULL) leaves the kernel default in place.
+struct socket_profile {
+	int rcvbuf;
+	int sndbuf;
+	int rcvlowat;
+	int notsent_lowat;
+	bool nodelay;
+	char *congestion;
+
+	// SO_BUSY_POLL in usecs, also sets SO_PREFER_BUSY_POLL
+	int busy_poll;
+	int busy_poll_budget;
+
+	// raise rcvbuf/sndbuf to the configured bandwidth x the measured
+	// RTT once connected, where that beats kernel autotuning
+	bool autotune;
+	long long bandwidth;	// bit/s, 0 picks SOCKET_DEFAULT_BANDWIDTH
+};
+
+#define SOCKET_DEFAULT_BANDWIDTH	100000000000LL
+
 int socket_create(char *address, int port);
+int socket_tune(int sockfd, struct socket_profile *);
+int socket_autotune(int sockfd, struct socket_profile *);
+int socket_set_pacing(int sockfd, long long rate);	// bit/s
 void socket_destroy(int sockfd);
 char *socket_get_error(void);
 
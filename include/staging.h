@@ -0,0 +1,26 @@
+#ifndef STAGING_H__
+#define STAGING_H__
+
+#include <stddef.h>
+
+#define STAGING_DEFAULT_NCHUNK		16
+#define STAGING_DEFAULT_CHUNK_SIZE	(1024 * 1024)
+
+typedef struct staging_pool *StagingPool;
+
+StagingPool staging_create(int nchunk, size_t chunk_size);
+
+void *staging_get(StagingPool );
+void staging_put(StagingPool , void *chunk);
+
+size_t staging_get_chunk_size(StagingPool );
+int staging_get_nchunk(StagingPool );
+
+// The one mapping all chunks live in, e.g. to register it with the kernel.
+void *staging_get_region(StagingPool , size_t *length);
+
+void staging_destroy(StagingPool );
+
+char *staging_get_error(void);
+
+#endif
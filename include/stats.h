@@ -0,0 +1,50 @@
+#ifndef STATS_H__
+#define STATS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+// Log-linear histogram: every power of two is split into
+// HISTOGRAM_SUBBUCKETS linear steps, which keeps the relative error of
+// a recorded value below 1 / HISTOGRAM_SUBBUCKETS.
+#define HISTOGRAM_SUBBITS	4
+#define HISTOGRAM_SUBBUCKETS	(1 << HISTOGRAM_SUBBITS)
+#define HISTOGRAM_BUCKETS	((64 - HISTOGRAM_SUBBITS + 1) * HISTOGRAM_SUBBUCKETS)
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+struct stats {
+	uint64_t start_ns;
+	uint64_t end_ns;
+
+	size_t bytes;
+	size_t calls;
+	size_t chunks;
+	size_t max_chunk;
+
+	struct histogram copy_ns;
+};
+
+uint64_t stats_now(void);
+
+void histogram_reset(struct histogram *);
+void histogram_record(struct histogram *, uint64_t value);
+void histogram_merge(struct histogram *, const struct histogram *);
+uint64_t histogram_percentile(const struct histogram *, double percentile);
+int histogram_describe(const struct histogram *, char *buffer, size_t size);
+
+void stats_reset(struct stats *);
+void stats_record_recv(struct stats *, ssize_t len);
+void stats_record_copy(struct stats *, uint64_t nanoseconds);
+void stats_merge(struct stats *, const struct stats *);
+
+int stats_describe(const struct stats *, char *buffer, size_t size);
+
+#endif
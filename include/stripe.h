@@ -0,0 +1,33 @@
+#ifndef STRIPE_H__
+#define STRIPE_H__
+
+#include <stdint.h>
+
+#include <endian.h>
+
+// Every connection of a striped transfer starts with this header, in
+// network byte order, followed by exactly len bytes that belong at offset.
+struct stripe_header {
+	uint64_t offset;
+	uint64_t len;
+	uint32_t index;
+	uint32_t count;
+};
+
+static inline void stripe_header_encode(struct stripe_header *header)
+{
+	header->offset = htobe64(header->offset);
+	header->len = htobe64(header->len);
+	header->index = htobe32(header->index);
+	header->count = htobe32(header->count);
+}
+
+static inline void stripe_header_decode(struct stripe_header *header)
+{
+	header->offset = be64toh(header->offset);
+	header->len = be64toh(header->len);
+	header->index = be32toh(header->index);
+	header->count = be32toh(header->count);
+}
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef UDMABUF_MEMORY_PROVIDER_H__
+#define UDMABUF_MEMORY_PROVIDER_H__
+
+#include "memory_provider.h"
+#include "memory_vector.h"
+
+#include <stddef.h>
+
+// Backs Memory with a sealed memfd turned into a dmabuf by /dev/udmabuf,
+// so devmem TCP can be bound and exercised without a GPU. The CPU
+// copies go through a mapping of the memfd, bracketed by
+// DMA_BUF_IOCTL_SYNC, and return the bytes copied.
+extern struct memory_provider udmabuf_memory_provider;
+
+// Where a Memory of this provider lives within its dmabuf, as
+// server_bind_devmem() and the dmabuf cmsgs see it.
+int udmabuf_memory_get_fd(Memory );
+size_t udmabuf_memory_get_offset(Memory );
+
+// Batched entry points for memory_memcpy_to_v()/memory_memcpy_from_v():
+// one DMA_BUF_IOCTL_SYNC pair covers every piece.
+int udmabuf_memory_memcpy_to_v(Memory , const struct memory_vec *,
+			       int count);
+int udmabuf_memory_memcpy_from_v(Memory , const struct memory_vec *,
+				 int count);
+
+#endif
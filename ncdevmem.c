@@ -12,6 +12,14 @@
  *     echo -n "hello\nworld" | \
  *		ncdevmem -s <server IP> [-c <client IP>] -p 5201 -f eth1
  *
+ * Frags are handed back to the kernel as soon as their copy lands; -r <frags>
+ * and -R <bytes> instead hold them until that many are pending, or until
+ * the socket has nothing more to read.
+ *
+ * Received frags are traced to memory rather than printed. -T 1 prints each
+ * recvmsg(), -T 2 each frag as well, -S <n> only every n'th of those, and
+ * -D <file> writes the last records out in binary at exit.
+ *
  * Note this is compatible with regular netcat. i.e. the sender or receiver can
  * be replaced with regular netcat to test the RX or TX path in isolation.
  *
@@ -55,6 +63,7 @@
 #include <sys/socket.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
 #include <sys/syscall.h>
 #include <sys/time.h>
 
@@ -88,6 +97,30 @@
 
 #define MAX_IOV 1024
 
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+	__u32 busy_poll_usecs;
+	__u16 busy_poll_budget;
+	__u8 prefer_busy_poll;
+	__u8 __pad;
+};
+
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+#define BUSY_POLL_BUDGET 64
+
+#define CTRL_DATA_SIZE (sizeof(int) * 20000)
+/* upper bound of the dmabuf frags one recvmsg() can report */
+#define MAX_FRAGS (CTRL_DATA_SIZE / CMSG_SPACE(sizeof(struct dmabuf_cmsg)))
+
+/* per SO_DEVMEM_DONTNEED call, as enforced by net/core/sock.c */
+#define DONTNEED_MAX_TOKENS 128
+#define DONTNEED_MAX_FRAGS 1024
+
+/* records kept for -D; a power of two */
+#define TRACE_RING_SIZE (1 << 16)
+
 static size_t max_chunk;
 static char *server_ip;
 static char *client_ip;
@@ -100,6 +133,13 @@ static unsigned int ifindex;
 static unsigned int dmabuf_id;
 static uint32_t tx_dmabuf_id;
 static int waittime_ms = 500;
+static int busy_poll_usecs;
+/* frags are returned once this many are copied; 0 for every copy */
+static size_t release_frags_at;
+static size_t release_bytes_at;
+static int trace_level;
+static unsigned int trace_sample = 1;
+static char *trace_file;
 
 struct memory_buffer {
 	int fd;
@@ -401,6 +441,61 @@ static void enable_reuseaddr(int fd)
 		error(1, errno, "%s: [FAIL, SO_REUSEADDR]\n", TEST_PREFIX);
 }
 
+static void enable_busy_poll(int fd)
+{
+	int opt = busy_poll_usecs;
+	int ret;
+
+	ret = setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &opt, sizeof(opt));
+	if (ret)
+		error(1, errno, "%s: [FAIL, SO_BUSY_POLL]\n", TEST_PREFIX);
+
+	opt = 1;
+	ret = setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &opt,
+			 sizeof(opt));
+	if (ret)
+		error(1, errno, "%s: [FAIL, SO_PREFER_BUSY_POLL]\n",
+		      TEST_PREFIX);
+
+	opt = BUSY_POLL_BUDGET;
+	ret = setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &opt,
+			 sizeof(opt));
+	if (ret)
+		error(1, errno, "%s: [FAIL, SO_BUSY_POLL_BUDGET]\n",
+		      TEST_PREFIX);
+}
+
+/* Wait for fd on an epoll instance that busy polls the rx queue before
+ * sleeping. Falls back to a zero-timeout spin when the kernel lacks
+ * EPIOCSPARAMS.
+ */
+static int create_busy_epoll(int fd, int *timeout)
+{
+	struct epoll_params params = {
+		.busy_poll_usecs = busy_poll_usecs,
+		.busy_poll_budget = BUSY_POLL_BUDGET,
+		.prefer_busy_poll = 1,
+	};
+	struct epoll_event ev = { .events = EPOLLIN };
+	int epfd;
+
+	epfd = epoll_create1(0);
+	if (epfd < 0)
+		error(1, errno, "%s: [FAIL, epoll_create1]\n", TEST_PREFIX);
+
+	ev.data.fd = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev))
+		error(1, errno, "%s: [FAIL, epoll_ctl]\n", TEST_PREFIX);
+
+	*timeout = -1;
+	if (ioctl(epfd, EPIOCSPARAMS, &params)) {
+		fprintf(stderr, "EPIOCSPARAMS unsupported, spinning\n");
+		*timeout = 0;
+	}
+
+	return epfd;
+}
+
 static int parse_address(const char *str, int port, struct sockaddr_in6 *sin6)
 {
 	int ret;
@@ -441,18 +536,255 @@ static struct netdev_queue_id *create_queues(void)
 	return queues;
 }
 
+/* Frag tokens in dmabuf_token form: runs of consecutive tokens share an
+ * entry, so one SO_DEVMEM_DONTNEED returns many frags.
+ */
+struct token_batch {
+	struct dmabuf_token tokens[MAX_FRAGS];
+	int ntokens;
+	size_t nfrags;
+	size_t bytes;
+};
+
+static bool token_batch_full(struct token_batch *batch)
+{
+	return batch->ntokens == MAX_FRAGS;
+}
+
+static void add_tokens(struct token_batch *batch, __u32 start, __u32 count,
+		       size_t bytes)
+{
+	struct dmabuf_token *last = batch->tokens + batch->ntokens - 1;
+
+	if (batch->ntokens > 0 &&
+	    last->token_start + last->token_count == start &&
+	    last->token_count + count <= DONTNEED_MAX_FRAGS) {
+		last->token_count += count;
+	} else {
+		batch->tokens[batch->ntokens].token_start = start;
+		batch->tokens[batch->ntokens].token_count = count;
+		batch->ntokens++;
+	}
+
+	batch->nfrags += count;
+	batch->bytes += bytes;
+}
+
+/* The kernel takes at most DONTNEED_MAX_TOKENS entries covering
+ * DONTNEED_MAX_FRAGS frags per call and returns the frags it freed.
+ */
+static void flush_tokens(int fd, struct token_batch *batch)
+{
+	int first = 0;
+	int ret;
+
+	while (first < batch->ntokens) {
+		size_t nfrags = 0;
+		int n = 0;
+
+		while (first + n < batch->ntokens &&
+		       n < DONTNEED_MAX_TOKENS &&
+		       nfrags + batch->tokens[first + n].token_count <=
+		       DONTNEED_MAX_FRAGS) {
+			nfrags += batch->tokens[first + n].token_count;
+			n++;
+		}
+
+		ret = setsockopt(fd, SOL_SOCKET, SO_DEVMEM_DONTNEED,
+				 &batch->tokens[first],
+				 sizeof(struct dmabuf_token) * n);
+		if (ret != nfrags)
+			error(1, 0, "SO_DEVMEM_DONTNEED not enough tokens");
+
+		first += n;
+	}
+
+	batch->ntokens = 0;
+	batch->nfrags = 0;
+	batch->bytes = 0;
+}
+
+static bool release_due(struct token_batch *pending)
+{
+	if (!release_frags_at && !release_bytes_at)
+		return true;
+
+	return (release_frags_at && pending->nfrags >= release_frags_at) ||
+	       (release_bytes_at && pending->bytes >= release_bytes_at);
+}
+
+/* Moves the frags of a batch to the pending release once the copies out
+ * of them landed, and returns the pending ones when the -r/-R policy (or
+ * force) says so.
+ */
+static void release_frags(int fd, hipEvent_t copied,
+			  struct token_batch *batch,
+			  struct token_batch *pending, bool force)
+{
+	if (batch->ntokens > 0) {
+		if (hipEventSynchronize(copied) != hipSuccess)
+			error(1, 0, "hipEventSynchronize failed");
+
+		for (int i = 0; i < batch->ntokens; i++) {
+			if (token_batch_full(pending))
+				flush_tokens(fd, pending);
+
+			add_tokens(pending, batch->tokens[i].token_start,
+				   batch->tokens[i].token_count, 0);
+		}
+		pending->bytes += batch->bytes;
+
+		batch->ntokens = 0;
+		batch->nfrags = 0;
+		batch->bytes = 0;
+	}
+
+	if (pending->ntokens > 0 && (force || release_due(pending)))
+		flush_tokens(fd, pending);
+}
+
+/* A run of frags that sit back to back in the dmabuf; they land back to
+ * back in tmp_mem too, so the whole run is one device copy.
+ */
+struct copy_run {
+	size_t src;
+	size_t dst;
+	size_t len;
+};
+
+static void flush_copy(struct memory_buffer *mem, char *tmp_mem,
+		       struct copy_run *run, hipStream_t stream,
+		       size_t *copies)
+{
+	if (!run->len)
+		return;
+
+	hipMemcpyAsync(tmp_mem + run->dst, mem->buf_mem + run->src, run->len,
+		       hipMemcpyDeviceToDevice, stream);
+	(*copies)++;
+
+	run->len = 0;
+}
+
+enum trace_type {
+	TRACE_RECVMSG,
+	TRACE_FRAG,
+	TRACE_LINEAR,
+};
+
+/* Fixed-size and binary, so tracing a frag costs a store and not a
+ * fprintf(). -D writes them out as they are.
+ */
+struct trace_record {
+	__u64 timestamp_ns;
+	__u64 offset;	/* recvmsg() return for TRACE_RECVMSG */
+	__u32 size;
+	__u32 token;
+	__u32 type;
+};
+
+static struct trace_record trace_ring[TRACE_RING_SIZE];
+static __u64 trace_head;
+/* per type, so -S samples every n'th of each and not of the ring */
+static __u64 trace_shown[TRACE_LINEAR + 1];
+
+static __u64 trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void trace_print(const struct trace_record *rec)
+{
+	switch (rec->type) {
+	case TRACE_RECVMSG:
+		fprintf(stderr, "%llu: recvmsg_ret=%lld\n",
+			rec->timestamp_ns, (long long)rec->offset);
+		break;
+	case TRACE_FRAG:
+		fprintf(stderr,
+			"%llu: received frag_page=%10llu, in_page_offset=%10llu, frag_offset=%10p, frag_size=%6u, token=%6u\n",
+			rec->timestamp_ns, rec->offset >> PAGE_SHIFT,
+			rec->offset % getpagesize(), (void *)rec->offset,
+			rec->size, rec->token);
+		break;
+	case TRACE_LINEAR:
+		fprintf(stderr, "%llu: SCM_DEVMEM_LINEAR. frag_size=%u\n",
+			rec->timestamp_ns, rec->size);
+		break;
+	}
+}
+
+/* Slots are claimed with one atomic add, so writers never wait; a full
+ * ring overwrites its oldest records. Only every -S'th record that -T
+ * asks for is printed: level 1 prints recvmsg()s, level 2 frags too.
+ */
+static void trace(enum trace_type type, __u64 timestamp_ns, __u64 offset,
+		  __u32 size, __u32 token)
+{
+	__u64 seq = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+	struct trace_record *rec = &trace_ring[seq & (TRACE_RING_SIZE - 1)];
+
+	rec->timestamp_ns = timestamp_ns;
+	rec->offset = offset;
+	rec->size = size;
+	rec->token = token;
+	rec->type = type;
+
+	if (trace_level < (type == TRACE_RECVMSG ? 1 : 2))
+		return;
+
+	if (__atomic_fetch_add(&trace_shown[type], 1, __ATOMIC_RELAXED) %
+	    trace_sample == 0)
+		trace_print(rec);
+}
+
+/* Writes the records still in the ring, oldest first. */
+static void trace_dump(const char *path)
+{
+	__u64 head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+	__u64 count = head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE;
+	FILE *file;
+
+	file = fopen(path, "w");
+	if (!file)
+		error(1, errno, "fopen %s", path);
+
+	for (__u64 seq = head - count; seq < head; seq++)
+		if (fwrite(&trace_ring[seq & (TRACE_RING_SIZE - 1)],
+			   sizeof(struct trace_record), 1, file) != 1)
+			error(1, errno, "fwrite %s", path);
+
+	fclose(file);
+
+	fprintf(stderr, "trace: %llu records, %llu dumped to %s\n",
+		head, count, path);
+}
+
 static int do_server(struct memory_buffer *mem)
 {
-	char ctrl_data[sizeof(int) * 20000];
+	/* two batches: one is copied while the next one is received */
+	static struct token_batch tokens[2];
+	static struct token_batch pending;
+	hipEvent_t copied[2];
+	int batch = 0;
+	char ctrl_data[CTRL_DATA_SIZE];
 	size_t non_page_aligned_frags = 0;
 	struct sockaddr_in6 client_addr;
 	struct sockaddr_in6 server_sin;
 	size_t page_aligned_frags = 0;
+	struct copy_run run = { 0 };
+	size_t copies = 0;
 	size_t total_received = 0;
 	socklen_t client_addr_len;
 	size_t endptr = -1;
 	bool is_devmem = false;
+	int epoll_timeout = -1;
+	int epfd = -1;
 	char *tmp_mem = NULL;
+	hipStream_t stream;
 	struct ynl_sock *ys;
 	char iobuf[819200];
 	char buffer[256];
@@ -487,6 +819,14 @@ static int do_server(struct memory_buffer *mem)
 	if (!tmp_mem)
 		error(1, ENOMEM, "malloc failed");
 
+	if (hipStreamCreate(&stream) != hipSuccess)
+		error(1, 0, "hipStreamCreate failed");
+
+	for (int i = 0; i < 2; i++)
+		if (hipEventCreateWithFlags(&copied[i],
+					    hipEventDisableTiming) != hipSuccess)
+			error(1, 0, "hipEventCreate failed");
+
 	socket_fd = socket(AF_INET6, SOCK_STREAM, 0);
 	if (socket_fd < 0)
 		error(1, errno, "%s: [FAIL, create socket]\n", TEST_PREFIX);
@@ -517,13 +857,28 @@ static int do_server(struct memory_buffer *mem)
 	fprintf(stderr, "Got connection from %s:%d\n", buffer,
 		ntohs(client_addr.sin6_port));
 
+	if (busy_poll_usecs) {
+		enable_busy_poll(client_fd);
+		epfd = create_busy_epoll(client_fd, &epoll_timeout);
+		fprintf(stderr, "busy polling for %d usecs\n",
+			busy_poll_usecs);
+	}
+
+	/* -r/-R hold frags back; a blocking recvmsg() could then sleep on
+	 * them while the rx queue runs dry, so read nonblocking and hand
+	 * them all back on EAGAIN before waiting
+	 */
+	if (busy_poll_usecs || release_frags_at || release_bytes_at)
+		fcntl(client_fd, F_SETFL,
+		      fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+
 	while (1) {
 		struct iovec iov = { .iov_base = iobuf,
 				     .iov_len = sizeof(iobuf) };
 		struct dmabuf_cmsg *dmabuf_cmsg = NULL;
 		struct cmsghdr *cm = NULL;
 		struct msghdr msg = { 0 };
-		struct dmabuf_token token;
+		__u64 now;
 		ssize_t ret;
 
 		is_devmem = false;
@@ -534,8 +889,21 @@ static int do_server(struct memory_buffer *mem)
 		msg.msg_controllen = sizeof(ctrl_data);
 		ret = recvmsg(client_fd, &msg, MSG_SOCK_DEVMEM);
 		// fprintf(stderr, "recvmsg ret=%ld\n", ret);
-		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			struct pollfd pfd = { .fd = client_fd,
+					      .events = POLLIN };
+			struct epoll_event ev;
+
+			/* don't sit on frags while the socket is idle */
+			release_frags(client_fd, copied[batch ^ 1],
+				      &tokens[batch ^ 1], &pending, true);
+
+			if (epfd >= 0)
+				epoll_wait(epfd, &ev, 1, epoll_timeout);
+			else
+				poll(&pfd, 1, -1);
 			continue;
+		}
 		if (ret < 0) {
 			perror("recvmsg");
 			continue;
@@ -544,7 +912,8 @@ static int do_server(struct memory_buffer *mem)
 			fprintf(stderr, "client exited\n");
 			break;
 		}
-		fprintf(stderr, "recvmsg_ret=%d\n", ret);
+		now = trace_now();
+		trace(TRACE_RECVMSG, now, ret, 0, 0);
 
 		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
 			if (cm->cmsg_level != SOL_SOCKET ||
@@ -561,9 +930,8 @@ static int do_server(struct memory_buffer *mem)
 				/* TODO: process data copied from skb's linear
 				 * buffer.
 				 */
-				fprintf(stderr,
-					"SCM_DEVMEM_LINEAR. dmabuf_cmsg->frag_size=%u\n",
-					dmabuf_cmsg->frag_size);
+				trace(TRACE_LINEAR, now, 0,
+				      dmabuf_cmsg->frag_size, 0);
 
 				continue;
 			}
@@ -585,12 +953,19 @@ static int do_server(struct memory_buffer *mem)
 
 			endptr += dmabuf_cmsg->frag_size;
 
-			hipMemcpy(
-				tmp_mem + total_received,
-				mem->buf_mem + dmabuf_cmsg->frag_offset,
-				dmabuf_cmsg->frag_size,
-				hipMemcpyDeviceToDevice
-			);
+			/* queue the copies of the whole batch, one per run
+			 * of adjacent frags; they are waited for only after
+			 * the next recvmsg()
+			 */
+			if (run.len &&
+			    run.src + run.len == dmabuf_cmsg->frag_offset) {
+				run.len += dmabuf_cmsg->frag_size;
+			} else {
+				flush_copy(mem, tmp_mem, &run, stream, &copies);
+				run.src = dmabuf_cmsg->frag_offset;
+				run.dst = total_received;
+				run.len = dmabuf_cmsg->frag_size;
+			}
 
 			/*
 			if (do_validation) {	
@@ -602,40 +977,56 @@ static int do_server(struct memory_buffer *mem)
 			}
 			*/
 
-			token.token_start = dmabuf_cmsg->frag_token;
-			token.token_count = 1;
-			ret = setsockopt(client_fd, SOL_SOCKET,
-					 SO_DEVMEM_DONTNEED, &token,
-					 sizeof(token));
-			if (ret != 1)
-				error(1, 0,
-				      "SO_DEVMEM_DONTNEED not enough tokens");
+			/* the frag may only be recycled once its copy landed */
+			add_tokens(&tokens[batch], dmabuf_cmsg->frag_token, 1,
+				   dmabuf_cmsg->frag_size);
 
 			total_received += dmabuf_cmsg->frag_size;
 
-			fprintf(stderr,
-				"received frag_page=%10llu, in_page_offset=%10llu, frag_offset=%10p, frag_size=%6u, token=%6u, total_received=%lu, dmabuf_id=%u\n",
-				dmabuf_cmsg->frag_offset >> PAGE_SHIFT,
-				dmabuf_cmsg->frag_offset % getpagesize(),
-				dmabuf_cmsg->frag_offset,
-				dmabuf_cmsg->frag_size, dmabuf_cmsg->frag_token,
-				total_received, dmabuf_cmsg->dmabuf_id);
+			trace(TRACE_FRAG, now, dmabuf_cmsg->frag_offset,
+			      dmabuf_cmsg->frag_size, dmabuf_cmsg->frag_token);
 		}
 
 		if (!is_devmem)
 			error(1, 0, "flow steering error\n");
 
+		/* runs end with the batch: its tokens go back on its event */
+		flush_copy(mem, tmp_mem, &run, stream, &copies);
+
+		if (tokens[batch].ntokens > 0 &&
+		    hipEventRecord(copied[batch], stream) != hipSuccess)
+			error(1, 0, "hipEventRecord failed");
+
+		/* the previous batch had a whole recvmsg() to land */
+		batch ^= 1;
+		release_frags(client_fd, copied[batch], &tokens[batch],
+			      &pending, false);
+
 		// fprintf(stderr, "total_received=%lu\n", total_received);
 	}
 
+	release_frags(client_fd, copied[batch ^ 1], &tokens[batch ^ 1],
+		      &pending, true);
+
 	fprintf(stderr, "%s: ok\n", TEST_PREFIX);
 
 	fprintf(stderr, "page_aligned_frags=%lu, non_page_aligned_frags=%lu\n",
 		page_aligned_frags, non_page_aligned_frags);
 
+	fprintf(stderr, "total_received=%lu, device_copies=%lu\n",
+		total_received, copies);
+
+	if (trace_file)
+		trace_dump(trace_file);
+
 cleanup:
 
+	for (int i = 0; i < 2; i++)
+		hipEventDestroy(copied[i]);
+	hipStreamDestroy(stream);
 	free(tmp_mem);
+	if (epfd >= 0)
+		close(epfd);
 	close(client_fd);
 	close(socket_fd);
 	ynl_sock_destroy(ys);
@@ -904,7 +1295,7 @@ int main(int argc, char *argv[])
 	int is_server = 0, opt;
 	int ret;
 
-	while ((opt = getopt(argc, argv, "ls:c:p:v:q:t:f:z:")) != -1) {
+	while ((opt = getopt(argc, argv, "ls:c:p:v:q:t:f:z:b:r:R:T:S:D:")) != -1) {
 		switch (opt) {
 		case 'l':
 			is_server = 1;
@@ -933,6 +1324,26 @@ int main(int argc, char *argv[])
 		case 'z':
 			max_chunk = atoi(optarg);
 			break;
+		case 'b':
+			busy_poll_usecs = atoi(optarg);
+			break;
+		case 'r':
+			release_frags_at = atoll(optarg);
+			break;
+		case 'R':
+			release_bytes_at = atoll(optarg);
+			break;
+		case 'T':
+			trace_level = atoi(optarg);
+			break;
+		case 'S':
+			trace_sample = atoi(optarg);
+			if (!trace_sample)
+				error(1, 0, "-S must be at least 1\n");
+			break;
+		case 'D':
+			trace_file = optarg;
+			break;
 		case '?':
 			fprintf(stderr, "unknown option: %c\n", optopt);
 			break;
@@ -0,0 +1,201 @@
+#include "arena.h"
+
+#include <stdio.h>	// BUFSIZ
+#include <stdbool.h>	// true, false
+#include <stdlib.h>	// malloc(), realloc()
+#include <string.h>	// memmove(), strerror()
+#include <errno.h>	// errno
+
+#include <pthread.h>	// pthread_mutex_*()
+
+#define ERROR(...) do {					\
+	snprintf(error, BUFSIZ, __VA_ARGS__);		\
+} while(false)
+
+struct extent {
+	size_t offset;
+	size_t len;
+};
+
+// Free spans sorted by offset and never adjacent: arena_free() merges a
+// span with its neighbours, so the list stays as short as the number of
+// holes. Allocation is first fit.
+struct arena {
+	size_t offset;
+	size_t size;
+	size_t align;
+
+	struct extent *extents;
+	int nextent;
+	int capacity;
+	size_t nfree;
+
+	pthread_mutex_t lock;
+};
+
+static __thread char error[BUFSIZ];
+
+static size_t arena_round(Arena arena, size_t len)
+{
+	return (len + arena->align - 1) / arena->align * arena->align;
+}
+
+Arena arena_create(size_t offset, size_t size, size_t align)
+{
+	Arena arena;
+
+	if (align == 0 || size < align) {
+		ERROR("invalid arena geometry: %zu aligned to %zu",
+		      size, align);
+		goto RETURN_NULL;
+	}
+
+	arena = malloc(sizeof(struct arena));
+	if (arena == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto RETURN_NULL;
+	}
+
+	arena->capacity = 16;
+	arena->extents = malloc(sizeof(struct extent) * arena->capacity);
+	if (arena->extents == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto FREE_ARENA;
+	}
+
+	// spans stay aligned relative to offset
+	arena->offset = offset;
+	arena->size = size / align * align;
+	arena->align = align;
+
+	arena->extents[0].offset = offset;
+	arena->extents[0].len = arena->size;
+	arena->nextent = 1;
+	arena->nfree = arena->size;
+
+	pthread_mutex_init(&arena->lock, NULL);
+
+	return arena;
+
+FREE_ARENA:	free(arena);
+RETURN_NULL:	return NULL;
+}
+
+int arena_alloc(Arena arena, size_t len, size_t *offset)
+{
+	int ret = -1;
+
+	len = arena_round(arena, len);
+	if (len == 0) {
+		ERROR("invalid length: 0");
+		return -1;
+	}
+
+	pthread_mutex_lock(&arena->lock);
+	for (int i = 0; i < arena->nextent; i++) {
+		struct extent *extent = &arena->extents[i];
+
+		if (extent->len < len)
+			continue;
+
+		*offset = extent->offset;
+		extent->offset += len;
+		extent->len -= len;
+
+		if (extent->len == 0) {
+			memmove(extent, extent + 1, sizeof(struct extent)
+				* (arena->nextent - i - 1));
+			arena->nextent--;
+		}
+
+		arena->nfree -= len;
+		ret = 0;
+		break;
+	}
+
+	if (ret == -1)
+		ERROR("no free span of %zu bytes (%zu free in %d spans)",
+		      len, arena->nfree, arena->nextent);
+	pthread_mutex_unlock(&arena->lock);
+
+	return ret;
+}
+
+void arena_free(Arena arena, size_t offset, size_t len)
+{
+	struct extent *extents;
+	bool merge_prev;
+	bool merge_next;
+	int i;
+
+	len = arena_round(arena, len);
+
+	pthread_mutex_lock(&arena->lock);
+	extents = arena->extents;
+
+	for (i = 0; i < arena->nextent; i++)
+		if (extents[i].offset > offset)
+			break;
+
+	merge_prev = i > 0
+		  && extents[i - 1].offset + extents[i - 1].len == offset;
+	merge_next = i < arena->nextent
+		  && offset + len == extents[i].offset;
+
+	if (merge_prev && merge_next) {
+		extents[i - 1].len += len + extents[i].len;
+		memmove(&extents[i], &extents[i + 1], sizeof(struct extent)
+			* (arena->nextent - i - 1));
+		arena->nextent--;
+	} else if (merge_prev) {
+		extents[i - 1].len += len;
+	} else if (merge_next) {
+		extents[i].offset = offset;
+		extents[i].len += len;
+	} else {
+		if (arena->nextent == arena->capacity) {
+			// on failure the span leaks; the arena stays usable
+			extents = realloc(extents, sizeof(struct extent)
+					  * arena->capacity * 2);
+			if (extents == NULL)
+				goto UNLOCK;
+
+			arena->extents = extents;
+			arena->capacity *= 2;
+		}
+
+		memmove(&extents[i + 1], &extents[i], sizeof(struct extent)
+			* (arena->nextent - i));
+		extents[i].offset = offset;
+		extents[i].len = len;
+		arena->nextent++;
+	}
+
+	arena->nfree += len;
+
+UNLOCK:	pthread_mutex_unlock(&arena->lock);
+}
+
+size_t arena_get_free(Arena arena)
+{
+	size_t nfree;
+
+	pthread_mutex_lock(&arena->lock);
+	nfree = arena->nfree;
+	pthread_mutex_unlock(&arena->lock);
+
+	return nfree;
+}
+
+void arena_destroy(Arena arena)
+{
+	pthread_mutex_destroy(&arena->lock);
+
+	free(arena->extents);
+	free(arena);
+}
+
+char *arena_get_error(void)
+{
+	return error;
+}
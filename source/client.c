@@ -1,6 +1,11 @@
 #include "client.h"
 
 #include "memory_provider.h"
+#include "staging.h"
+#include "pipeline.h"
+#include "stripe.h"
+#include "stats.h"
+#include "socket.h"
 
 #include <stdio.h>	// BUFSIZ
 #include <string.h>	// strerror()
@@ -8,9 +13,41 @@
 #include <stdlib.h>	// malloc()
 #include <stddef.h>	// size_t
 #include <stdbool.h>	// false
+#include <stdint.h>	// uint32_t
+#include <poll.h>	// poll()
 
-#include <sys/socket.h>	// connect()
+#include <unistd.h>	// close()
+#include <pthread.h>	// pthread_create(), pthread_join()
+#include <time.h>	// nanosleep()
+
+#include <sys/socket.h>	// connect(), MSG_ZEROCOPY
 #include <arpa/inet.h>	// struct sockaddr_in
+#include <netinet/in.h>	// IP_RECVERR, IPV6_RECVERR
+#include <netinet/tcp.h>	// TCP_NODELAY
+#include <linux/errqueue.h>	// struct sock_extended_err
+
+#include <liburing.h>	// io_uring_*()
+
+#define PIPELINE_DEPTH		4
+#define ZEROCOPY_INFLIGHT	8
+#define ZEROCOPY_TIMEOUT	1000	// ms between checks of the connection
+
+#define MAX_STREAMS		64
+
+#define PINGPONG_MESSAGE_SIZE	64
+#define PINGPONG_ITERATIONS	100000
+
+#define URING_ENTRIES		256
+#define URING_BATCH		32
+
+// send_zc usage reporting arrived in Linux 6.2
+#ifndef IORING_SEND_ZC_REPORT_USAGE
+#define IORING_SEND_ZC_REPORT_USAGE	(1U << 3)
+#endif
+
+#ifndef IORING_NOTIF_USAGE_ZC_COPIED
+#define IORING_NOTIF_USAGE_ZC_COPIED	(1U << 31)
+#endif
 
 #define ERROR(...) do {					\
 	snprintf(error, BUFSIZ, __VA_ARGS__);		\
@@ -18,14 +55,67 @@
 
 struct client {
 	int sockfd;
+	struct memory_provider *provider;
 	Memory context;
 	size_t size;
+
+	StagingPool staging;
+	struct socket_profile *profile;
+
+	bool zerocopy;
+	struct client_zerocopy zerocopy_stats;
+
+	long long rate;
+	int duration;
+
+	size_t message_size;
+	int iterations;
+	struct histogram rtt_ns;
 };
 
-static char error[BUFSIZ];
-static struct memory_provider *provider = &amdgpu_memory_provider;
+// Userspace token bucket, used when the kernel can't pace for us. The
+// balance may go negative: the sender then sleeps until it is repaid.
+struct pacer {
+	uint64_t rate;		// bytes per second, 0 for unpaced
+	double burst;
+	double tokens;
+	uint64_t last_ns;
+};
+
+// One connection sending [offset, offset + len) of the context.
+struct stream {
+	Client client;
+	int sockfd;
+	size_t offset;
+	size_t len;
+	StagingPool staging;
+
+	bool zerocopy;
+	long long rate;
+	uint64_t deadline;	// ns, resend the range until then if set
+	struct pacer pacer;
+
+	// MSG_ZEROCOPY sends get consecutive ids; a chunk is reusable
+	// once the id of its last send is below completed
+	uint32_t next_id;
+	uint32_t completed;
+	struct inflight {
+		char *chunk;
+		uint32_t last_id;
+	} inflight[ZEROCOPY_INFLIGHT];
+	int head;
+	int ninflight;
+	struct client_zerocopy zerocopy_stats;
 
-Client client_setup(int sockfd, Memory context)
+	pthread_t tid;
+	int ret;
+	char message[BUFSIZ];
+};
+
+static __thread char error[BUFSIZ];
+
+Client client_setup(int sockfd, struct memory_provider *provider,
+		    Memory context)
 {
 	Client client;
 
@@ -36,71 +126,974 @@ Client client_setup(int sockfd, Memory context)
 	}
 
 	client->sockfd = sockfd;
+	client->provider = provider;
 	client->context = context;
 	client->size = provider->get_size(context);
+	client->staging = NULL;
+	client->profile = NULL;
+	client->zerocopy = false;
+	memset(&client->zerocopy_stats, 0x00, sizeof(struct client_zerocopy));
+	client->rate = 0;
+	client->duration = 0;
+	client->message_size = PINGPONG_MESSAGE_SIZE;
+	client->iterations = PINGPONG_ITERATIONS;
+	histogram_reset(&client->rtt_ns);
 
 	return client;
 }
 
+void client_set_staging(Client client, StagingPool staging)
+{
+	client->staging = staging;
+}
+
+void client_set_profile(Client client, struct socket_profile *profile)
+{
+	client->profile = profile;
+}
+
+void client_set_zerocopy(Client client, bool zerocopy)
+{
+	client->zerocopy = zerocopy;
+}
+
+void client_set_pacing(Client client, long long rate, int duration)
+{
+	client->rate = rate;
+	client->duration = duration;
+}
+
+void client_set_pingpong(Client client, size_t message_size, int iterations)
+{
+	if (message_size > 0)
+		client->message_size = message_size;
+	if (iterations > 0)
+		client->iterations = iterations;
+}
+
+static void pacer_start(struct pacer *pacer, uint64_t rate, size_t burst)
+{
+	pacer->rate = rate;
+	pacer->burst = burst;
+	pacer->tokens = burst;
+	pacer->last_ns = stats_now();
+}
+
+static void pacer_wait(struct pacer *pacer, size_t len)
+{
+	struct timespec delay;
+	uint64_t deficit;
+	uint64_t now;
+
+	if (pacer->rate == 0)
+		return;
+
+	now = stats_now();
+	pacer->tokens += (now - pacer->last_ns) / 1e9 * pacer->rate;
+	if (pacer->tokens > pacer->burst)
+		pacer->tokens = pacer->burst;
+	pacer->last_ns = now;
+
+	pacer->tokens -= len;
+	if (pacer->tokens >= 0)
+		return;
+
+	deficit = -pacer->tokens / pacer->rate * 1e9;
+	delay.tv_sec = deficit / 1000000000;
+	delay.tv_nsec = deficit % 1000000000;
+	nanosleep(&delay, NULL);
+}
+
+// Prefers SO_MAX_PACING_RATE, which spaces packets rather than chunks.
+static void client_start_pacing(struct stream *stream)
+{
+	size_t burst = staging_get_chunk_size(stream->staging);
+
+	pacer_start(&stream->pacer, 0, burst);
+
+	if (stream->rate <= 0)
+		return;
+
+	if (socket_set_pacing(stream->sockfd, stream->rate) == -1)
+		pacer_start(&stream->pacer, stream->rate / 8, burst);
+}
+
+// Releases the chunks whose sends the kernel no longer references.
+static void client_release(struct stream *stream)
+{
+	while (stream->ninflight > 0) {
+		struct inflight *inflight = &stream->inflight[stream->head];
+
+		if ((int32_t) (inflight->last_id - stream->completed) >= 0)
+			break;
+
+		staging_put(stream->staging, inflight->chunk);
+
+		stream->head = (stream->head + 1) % ZEROCOPY_INFLIGHT;
+		stream->ninflight--;
+	}
+}
+
+// Reads MSG_ZEROCOPY completions off the error queue. Each one covers the
+// range [ee_info, ee_data] of send ids, and TCP completes them in order.
+static int client_reap(struct stream *stream, bool block)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 8];
+	struct sock_extended_err *serr;
+	struct pollfd pfd;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	int ret;
+
+	// a completion only comes once its chunk is acked, which takes as
+	// long as the path (or the pacing) makes it; a failed connection
+	// is the one reason to stop waiting
+	while (block) {
+		socklen_t len = sizeof(int);
+		int failure;
+
+		pfd.fd = stream->sockfd;
+		pfd.events = 0;
+		pfd.revents = 0;
+
+		ret = poll(&pfd, 1, ZEROCOPY_TIMEOUT);
+		if (ret == -1 && errno != EINTR) {
+			ERROR("failed to poll(): %s", strerror(errno));
+			return -1;
+		}
+
+		// acks stop with the connection, completions may not
+		if (ret > 0 && (pfd.revents & (POLLERR | POLLHUP)) == POLLHUP) {
+			ERROR("did not receive a zerocopy completion: "
+	 		      "connection closed");
+			return -1;
+		}
+
+		if (ret > 0)
+			break;
+
+		if (getsockopt(stream->sockfd, SOL_SOCKET, SO_ERROR,
+			       &failure, &len) == -1) {
+			ERROR("failed to getsockopt(SO_ERROR): %s",
+	 		      strerror(errno));
+			return -1;
+		}
+
+		if (failure != 0) {
+			ERROR("did not receive a zerocopy completion: %s",
+	 		      strerror(failure));
+			return -1;
+		}
+	}
+
+	while (true) {
+		memset(&msg, 0x00, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		ret = recvmsg(stream->sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+		if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+
+		if (ret == -1) {
+			ERROR("failed to recvmsg(MSG_ERRQUEUE): %s",
+	 		      strerror(errno));
+			return -1;
+		}
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if ( !(cm->cmsg_level == SOL_IP
+			       && cm->cmsg_type == IP_RECVERR)
+			    && !(cm->cmsg_level == SOL_IPV6
+				 && cm->cmsg_type == IPV6_RECVERR) )
+				continue;
+
+			serr = (struct sock_extended_err *) CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+				ERROR("unexpected error queue origin: %u",
+	  			      serr->ee_origin);
+				return -1;
+			}
+
+			if (serr->ee_errno != 0) {
+				ERROR("zerocopy send failed: %s",
+	  			      strerror(serr->ee_errno));
+				return -1;
+			}
+
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				stream->zerocopy_stats.copied +=
+					serr->ee_data - serr->ee_info + 1;
+			else
+				stream->zerocopy_stats.zerocopied +=
+					serr->ee_data - serr->ee_info + 1;
+
+			stream->completed = serr->ee_data + 1;
+		}
+	}
+}
+
+static int client_send(struct stream *stream, char *buffer, size_t len)
+{
+	bool zerocopy = stream->zerocopy;
+	int flags = zerocopy ? MSG_ZEROCOPY : 0;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = send(stream->sockfd, buffer, len, flags);
+		if (ret == -1 && errno == ENOBUFS && stream->ninflight > 0) {
+			// out of optmem for notifications, wait for some
+			if (client_reap(stream, true) == -1)
+				return -1;
+			continue;
+		}
+
+		if (ret == -1) {
+			ERROR("failed to send(): %s", strerror(errno));
+			return -1;
+		}
+
+		if (zerocopy) {
+			stream->next_id++;
+			stream->zerocopy_stats.sends++;
+		}
+
+		buffer += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+// Sends the range of a connected stream.
+static int client_transfer(struct stream *stream)
+{
+	Client client = stream->client;
+	Pipeline pipeline;
+	int maxinflight;
+	int ret;
+
+	// every chunk in flight stays out of the pool until completion
+	maxinflight = staging_get_nchunk(stream->staging);
+	if (maxinflight > ZEROCOPY_INFLIGHT)
+		maxinflight = ZEROCOPY_INFLIGHT;
+
+	if (stream->zerocopy) {
+		int one = 1;
+
+		ret = setsockopt(stream->sockfd, SOL_SOCKET, SO_ZEROCOPY,
+		   		 &one, sizeof(one));
+		if (ret == -1) {
+			ERROR("failed to setsockopt(SO_ZEROCOPY): %s",
+	 		      strerror(errno));
+			goto RETURN_ERROR;
+		}
+	}
+
+	stream->next_id = 0;
+	stream->completed = 0;
+	stream->head = 0;
+	stream->ninflight = 0;
+	memset(&stream->zerocopy_stats, 0x00, sizeof(struct client_zerocopy));
+
+	// the device read of the next chunks overlaps the send of this one
+	pipeline = pipeline_create_reader(client->provider, client->context,
+					  stream->staging, PIPELINE_DEPTH,
+					  stream->offset, stream->len);
+	if (pipeline == NULL) {
+		ERROR("failed to pipeline_create_reader(): %s",
+		      pipeline_get_error());
+		goto RETURN_ERROR;
+	}
+
+	client_start_pacing(stream);
+
+	while (true) {
+		size_t offset;
+		void *chunk;
+		ssize_t len;
+
+		if (stream->deadline != 0 && stats_now() >= stream->deadline)
+			break;
+
+		while (stream->ninflight == maxinflight) {
+			if (client_reap(stream, true) == -1)
+				goto RELEASE_INFLIGHT;
+			client_release(stream);
+		}
+
+		len = pipeline_next(pipeline, &chunk, &offset);
+		if (len == -1) {
+			ERROR("failed to pipeline_next(): %s",
+	 		      pipeline_get_error());
+			goto RELEASE_INFLIGHT;
+		}
+
+		// start over for as long as the run lasts
+		if (len == 0 && stream->deadline != 0) {
+			pipeline_destroy(pipeline);
+			pipeline = pipeline_create_reader(client->provider,
+							  client->context,
+					    		  stream->staging,
+					    		  PIPELINE_DEPTH,
+					    		  stream->offset,
+					    		  stream->len);
+			if (pipeline == NULL) {
+				ERROR("failed to pipeline_create_reader(): %s",
+	  			      pipeline_get_error());
+				goto RELEASE_INFLIGHT;
+			}
+			continue;
+		}
+
+		if (len == 0)
+			break;
+
+		pacer_wait(&stream->pacer, len);
+
+		if (client_send(stream, chunk, len) == -1) {
+			staging_put(stream->staging, chunk);
+			goto RELEASE_INFLIGHT;
+		}
+
+		if ( !stream->zerocopy ) {
+			staging_put(stream->staging, chunk);
+		} else {
+			int tail = (stream->head + stream->ninflight)
+				% ZEROCOPY_INFLIGHT;
+
+			stream->inflight[tail].chunk = chunk;
+			stream->inflight[tail].last_id = stream->next_id - 1;
+			stream->ninflight++;
+
+			if (client_reap(stream, false) == -1)
+				goto RELEASE_INFLIGHT;
+			client_release(stream);
+		}
+	}
+
+	while (stream->ninflight > 0) {
+		if (client_reap(stream, true) == -1)
+			goto RELEASE_INFLIGHT;
+		client_release(stream);
+	}
+
+	pipeline_destroy(pipeline);
+
+	return 0;
+
+RELEASE_INFLIGHT:
+		stream->completed = stream->next_id;
+		client_release(stream);
+		if (pipeline != NULL)
+			pipeline_destroy(pipeline);
+RETURN_ERROR:	return -1;
+}
+
+static void client_count_zerocopy(Client client, struct stream *stream)
+{
+	client->zerocopy_stats.sends += stream->zerocopy_stats.sends;
+	client->zerocopy_stats.zerocopied += stream->zerocopy_stats.zerocopied;
+	client->zerocopy_stats.copied += stream->zerocopy_stats.copied;
+}
+
 int client_run_as_tcp(Client client,
 		      struct sockaddr *sockaddr, socklen_t addrlen)
 {
-	size_t sendlen;
-	char *ubuffer;
-	size_t size;
-	Memory context;
+	struct stream stream;
 	int ret;
 
-	size = client->size;
-	context = client->context;
+	memset(&client->zerocopy_stats, 0x00, sizeof(struct client_zerocopy));
+
+	stream.client = client;
+	stream.sockfd = client->sockfd;
+	stream.offset = 0;
+	stream.len = client->size;
+	stream.zerocopy = client->zerocopy;
+	stream.rate = client->rate;
+
+	stream.staging = client->staging;
+	if (stream.staging == NULL) {
+		stream.staging = staging_create(STAGING_DEFAULT_NCHUNK,
+				 		STAGING_DEFAULT_CHUNK_SIZE);
+		if (stream.staging == NULL) {
+			ERROR("failed to staging_create(): %s",
+	 		      staging_get_error());
+			goto RETURN_ERROR;
+		}
+	}
 
-	ubuffer = malloc(size);
-	if (ubuffer == NULL) {
+	ret = connect(client->sockfd, sockaddr, addrlen);
+	if (ret == -1) {
+		ERROR("failed to connect(): %s", strerror(errno));
+		goto DESTROY_STAGING;
+	}
+
+	if (client->profile != NULL) {
+		if (socket_autotune(client->sockfd, client->profile) == -1) {
+			ERROR("failed to socket_autotune(): %s",
+	 		      socket_get_error());
+			goto DESTROY_STAGING;
+		}
+	}
+
+	stream.deadline = 0;
+	if (client->duration > 0)
+		stream.deadline = stats_now() + client->duration * 1000000000ULL;
+
+	ret = client_transfer(&stream);
+	client_count_zerocopy(client, &stream);
+	if (ret == -1)
+		goto DESTROY_STAGING;
+
+	if (stream.staging != client->staging)
+		staging_destroy(stream.staging);
+
+	return 0;
+
+DESTROY_STAGING:
+		if (stream.staging != client->staging)
+			staging_destroy(stream.staging);
+RETURN_ERROR:	return -1;
+}
+
+static int client_connect_stream(struct stream *stream, int index, int count,
+				 struct sockaddr *sockaddr, socklen_t addrlen)
+{
+	struct socket_profile *profile = stream->client->profile;
+	struct stripe_header header;
+	ssize_t ret;
+
+	stream->sockfd = socket(sockaddr->sa_family, SOCK_STREAM, 0);
+	if (stream->sockfd == -1) {
+		ERROR("failed to socket(): %s", strerror(errno));
+		goto RETURN_ERROR;
+	}
+
+	if (profile != NULL && socket_tune(stream->sockfd, profile) == -1) {
+		ERROR("failed to socket_tune(): %s", socket_get_error());
+		goto CLOSE_SOCKFD;
+	}
+
+	if (connect(stream->sockfd, sockaddr, addrlen) == -1) {
+		ERROR("failed to connect(): %s", strerror(errno));
+		goto CLOSE_SOCKFD;
+	}
+
+	if (profile != NULL && socket_autotune(stream->sockfd, profile) == -1) {
+		ERROR("failed to socket_autotune(): %s", socket_get_error());
+		goto CLOSE_SOCKFD;
+	}
+
+	header.offset = stream->offset;
+	header.len = stream->len;
+	header.index = index;
+	header.count = count;
+	stripe_header_encode(&header);
+
+	ret = send(stream->sockfd, &header, sizeof(header), 0);
+	if (ret != sizeof(header)) {
+		ERROR("failed to send() the stripe header: %s",
+		      ret == -1 ? strerror(errno) : "short send");
+		goto CLOSE_SOCKFD;
+	}
+
+	return 0;
+
+CLOSE_SOCKFD:	close(stream->sockfd);
+RETURN_ERROR:	return -1;
+}
+
+static void *client_run_stream(void *arg)
+{
+	struct stream *stream = arg;
+
+	stream->ret = client_transfer(stream);
+	if (stream->ret == -1)
+		snprintf(stream->message, BUFSIZ, "%s", error);
+
+	return NULL;
+}
+
+// Each stream gets a private pool: a stream waiting for its reader must
+// not starve because others hold every chunk in zerocopy sends.
+int client_run_as_striped(Client client, struct sockaddr *sockaddr,
+			  socklen_t addrlen, int nstream)
+{
+	struct stream *streams;
+	size_t chunk_size;
+	size_t stripe;
+	int nchunk;
+	int nstarted;
+	int ret;
+
+	if (nstream <= 0 || nstream > MAX_STREAMS) {
+		ERROR("invalid number of streams: %d", nstream);
+		goto RETURN_ERROR;
+	}
+
+	memset(&client->zerocopy_stats, 0x00, sizeof(struct client_zerocopy));
+
+	chunk_size = STAGING_DEFAULT_CHUNK_SIZE;
+	nchunk = STAGING_DEFAULT_NCHUNK;
+	if (client->staging != NULL) {
+		chunk_size = staging_get_chunk_size(client->staging);
+		nchunk = staging_get_nchunk(client->staging);
+	}
+
+	nchunk /= nstream;
+	if (nchunk < 2)
+		nchunk = 2;
+
+	streams = malloc(sizeof(struct stream) * nstream);
+	if (streams == NULL) {
 		ERROR("failed to malloc(): %s", strerror(errno));
 		goto RETURN_ERROR;
 	}
 
+	stripe = client->size / nstream;
+
+	nstarted = 0;
+	for (int i = 0; i < nstream; i++) {
+		struct stream *stream = &streams[i];
+
+		stream->client = client;
+		stream->offset = stripe * i;
+		stream->len = i == nstream - 1 ? client->size - stream->offset
+					       : stripe;
+
+		// each stripe is sent exactly once, at its share of the rate
+		stream->zerocopy = client->zerocopy;
+		stream->rate = client->rate / nstream;
+		stream->deadline = 0;
+
+		stream->staging = staging_create(nchunk, chunk_size);
+		if (stream->staging == NULL) {
+			ERROR("failed to staging_create(): %s",
+	 		      staging_get_error());
+			goto JOIN_STREAMS;
+		}
+
+		if (client_connect_stream(stream, i, nstream,
+			    		  sockaddr, addrlen) == -1) {
+			staging_destroy(stream->staging);
+			goto JOIN_STREAMS;
+		}
+
+		if (pthread_create(&stream->tid, NULL,
+		     		   client_run_stream, stream)) {
+			ERROR("failed to pthread_create()");
+			close(stream->sockfd);
+			staging_destroy(stream->staging);
+			goto JOIN_STREAMS;
+		}
+
+		nstarted++;
+	}
+
+	ret = 0;
+	for (int i = 0; i < nstream; i++) {
+		pthread_join(streams[i].tid, NULL);
+
+		client_count_zerocopy(client, &streams[i]);
+		if (streams[i].ret == -1 && ret == 0) {
+			ERROR("stream %d: %s", i, streams[i].message);
+			ret = -1;
+		}
+
+		close(streams[i].sockfd);
+		staging_destroy(streams[i].staging);
+	}
+
+	free(streams);
+
+	return ret;
+
+JOIN_STREAMS:	for (int i = 0; i < nstarted; i++) {
+			pthread_join(streams[i].tid, NULL);
+			close(streams[i].sockfd);
+			staging_destroy(streams[i].staging);
+		}
+		free(streams);
+RETURN_ERROR:	return -1;
+}
+
+// The whole staging pool is registered as fixed buffer 0, so every chunk
+// is sent with IORING_OP_SEND_ZC without pinning pages per request.
+struct uring_sender {
+	struct io_uring ring;
+	Pipeline pipeline;
+	StagingPool staging;
+
+	// chunks the kernel may still read, indexed by user_data
+	void **held;
+	int nchunk;
+	int nheld;
+
+	int nsending;
+	bool eof;
+};
+
+static int uring_hold(struct uring_sender *sender, void *chunk)
+{
+	int slot;
+
+	for (slot = 0; sender->held[slot] != NULL; slot++)
+		;
+
+	sender->held[slot] = chunk;
+	sender->nheld++;
+
+	return slot;
+}
+
+static void uring_release(struct uring_sender *sender, int slot)
+{
+	staging_put(sender->staging, sender->held[slot]);
+	sender->held[slot] = NULL;
+	sender->nheld--;
+}
+
+// Sends of one batch are linked, as io_uring is otherwise free to reorder
+// sends on a socket that had to wait for space. For the same reason a
+// batch is only queued once the previous one has been sent, while the
+// notifications of its buffers may still be outstanding.
+static int uring_queue_batch(Client client, struct uring_sender *sender,
+			     int sockfd)
+{
+	struct io_uring_sqe *sqe = NULL;
+	int nbatch = 0;
+
+	while (nbatch < URING_BATCH && sender->nheld < sender->nchunk) {
+		size_t offset;
+		void *chunk;
+		ssize_t len;
+		int slot;
+
+		len = pipeline_next(sender->pipeline, &chunk, &offset);
+		if (len == -1) {
+			ERROR("failed to pipeline_next(): %s",
+	 		      pipeline_get_error());
+			return -1;
+		}
+
+		if (len == 0) {
+			sender->eof = true;
+			break;
+		}
+
+		slot = uring_hold(sender, chunk);
+
+		sqe = io_uring_get_sqe(&sender->ring);
+		if (sqe == NULL) {
+			ERROR("failed to io_uring_get_sqe(): "
+	 		      "submission queue is full");
+			return -1;
+		}
+
+		io_uring_prep_send_zc_fixed(sqe, sockfd, chunk, len,
+			      		    MSG_WAITALL,
+			      		    IORING_SEND_ZC_REPORT_USAGE, 0);
+		sqe->flags |= IOSQE_IO_LINK;
+		io_uring_sqe_set_data64(sqe, slot);
+
+		nbatch++;
+	}
+
+	if (sqe != NULL)
+		sqe->flags &= ~IOSQE_IO_LINK;
+
+	sender->nsending += nbatch;
+	client->zerocopy_stats.sends += nbatch;
+
+	return 0;
+}
+
+// A send completes twice: once it is queued on the socket (with
+// IORING_CQE_F_MORE set) and once the kernel is done with the buffer.
+static int uring_handle_cqe(Client client, struct uring_sender *sender,
+			    struct io_uring_cqe *cqe)
+{
+	int slot = io_uring_cqe_get_data64(cqe);
+
+	if (cqe->flags & IORING_CQE_F_NOTIF) {
+		if (cqe->res & IORING_NOTIF_USAGE_ZC_COPIED)
+			client->zerocopy_stats.copied++;
+		else
+			client->zerocopy_stats.zerocopied++;
+
+		uring_release(sender, slot);
+		return 0;
+	}
+
+	sender->nsending--;
+
+	if (cqe->res < 0) {
+		ERROR("failed to IORING_OP_SEND_ZC: %s", strerror(-cqe->res));
+		return -1;
+	}
+
+	if ( !(cqe->flags & IORING_CQE_F_MORE) )
+		uring_release(sender, slot);
+
+	return 0;
+}
+
+int client_run_as_uring(Client client,
+			struct sockaddr *sockaddr, socklen_t addrlen)
+{
+	struct io_uring_cqe *cqes[URING_ENTRIES];
+	struct uring_sender sender;
+	struct iovec region;
+	int ret;
+
+	memset(&client->zerocopy_stats, 0x00, sizeof(struct client_zerocopy));
+
+	sender.staging = client->staging;
+	if (sender.staging == NULL) {
+		sender.staging = staging_create(STAGING_DEFAULT_NCHUNK,
+				 		STAGING_DEFAULT_CHUNK_SIZE);
+		if (sender.staging == NULL) {
+			ERROR("failed to staging_create(): %s",
+	 		      staging_get_error());
+			goto RETURN_ERROR;
+		}
+	}
+
+	sender.nchunk = staging_get_nchunk(sender.staging);
+	sender.nheld = 0;
+	sender.nsending = 0;
+	sender.eof = false;
+
+	sender.held = calloc(sender.nchunk, sizeof(void *));
+	if (sender.held == NULL) {
+		ERROR("failed to calloc(): %s", strerror(errno));
+		goto DESTROY_STAGING;
+	}
+
+	sender.pipeline = pipeline_create_reader(client->provider,
+						 client->context,
+					  	 sender.staging, PIPELINE_DEPTH,
+					  	 0, client->size);
+	if (sender.pipeline == NULL) {
+		ERROR("failed to pipeline_create_reader(): %s",
+		      pipeline_get_error());
+		goto FREE_HELD;
+	}
+
+	ret = io_uring_queue_init(URING_ENTRIES, &sender.ring, 0);
+	if (ret < 0) {
+		ERROR("failed to io_uring_queue_init(): %s", strerror(-ret));
+		goto DESTROY_PIPELINE;
+	}
+
+	region.iov_base = staging_get_region(sender.staging, &region.iov_len);
+
+	ret = io_uring_register_buffers(&sender.ring, &region, 1);
+	if (ret < 0) {
+		ERROR("failed to io_uring_register_buffers(): %s",
+		      strerror(-ret));
+		goto EXIT_QUEUE;
+	}
+
 	ret = connect(client->sockfd, sockaddr, addrlen);
 	if (ret == -1) {
 		ERROR("failed to connect(): %s", strerror(errno));
-		goto FREE_BUFFER;
+		goto EXIT_QUEUE;
 	}
 
-	sendlen = 0;
-	while (true) {
-		provider->memcpy_from(
-			ubuffer, context, sendlen, size - sendlen
-		);
+	if (client->profile != NULL) {
+		if (socket_autotune(client->sockfd, client->profile) == -1) {
+			ERROR("failed to socket_autotune(): %s",
+	 		      socket_get_error());
+			goto EXIT_QUEUE;
+		}
+	}
 
-		ret = send(client->sockfd, ubuffer, size - sendlen, 0);
-		if (ret == -1) {
-			ERROR("failed to send(): %s", strerror(errno));
-			goto CLOSE_CLNT_FD;
+	while ( !sender.eof || sender.nheld > 0 ) {
+		unsigned int ncqe;
+
+		if ( !sender.eof && sender.nsending == 0 ) {
+			if (uring_queue_batch(client, &sender,
+			    		      client->sockfd) == -1)
+				goto EXIT_QUEUE;
 		}
 
-		if (ret == 0)
-			break;
+		if (sender.nheld == 0)
+			continue;
+
+		ret = io_uring_submit_and_wait(&sender.ring, 1);
+		if (ret < 0 && ret != -EINTR) {
+			ERROR("failed to io_uring_submit_and_wait(): %s",
+	 		      strerror(-ret));
+			goto EXIT_QUEUE;
+		}
+
+		// reap everything that is ready in one go
+		ncqe = io_uring_peek_batch_cqe(&sender.ring, cqes,
+				 	       URING_ENTRIES);
+		for (unsigned int i = 0; i < ncqe; i++) {
+			if (uring_handle_cqe(client, &sender, cqes[i]) == -1) {
+				io_uring_cq_advance(&sender.ring, ncqe);
+				goto EXIT_QUEUE;
+			}
+		}
+
+		io_uring_cq_advance(&sender.ring, ncqe);
+	}
+
+	io_uring_unregister_buffers(&sender.ring);
+	io_uring_queue_exit(&sender.ring);
+	pipeline_destroy(sender.pipeline);
+	free(sender.held);
+	if (sender.staging != client->staging)
+		staging_destroy(sender.staging);
+
+	return 0;
+
+EXIT_QUEUE:	io_uring_queue_exit(&sender.ring);
+		for (int i = 0; i < sender.nchunk; i++)
+			if (sender.held[i] != NULL)
+				uring_release(&sender, i);
+DESTROY_PIPELINE:
+		pipeline_destroy(sender.pipeline);
+FREE_HELD:	free(sender.held);
+DESTROY_STAGING:
+		if (sender.staging != client->staging)
+			staging_destroy(sender.staging);
+RETURN_ERROR:	return -1;
+}
+
+static int client_recv_all(int sockfd, char *buffer, size_t len)
+{
+	while (len > 0) {
+		ssize_t ret = recv(sockfd, buffer, len, 0);
+
+		if (ret == -1 && errno == EINTR)
+			continue;
 
-		ret = provider->memcpy_to(context, ubuffer, sendlen, ret);
 		if (ret == -1) {
-			ERROR("failed to amdgpu_memory_provider->memcpy_to(): "
-	 		      "%s", provider->get_error());
-			goto CLOSE_CLNT_FD;
+			ERROR("failed to recv(): %s", strerror(errno));
+			return -1;
+		}
+
+		if (ret == 0) {
+			ERROR("server closed the connection");
+			return -1;
+		}
+
+		buffer += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+// Each round trip reads the message out of device memory, sends it,
+// waits for the whole echo and writes it back; all of it is timed.
+int client_run_as_pingpong(Client client,
+			   struct sockaddr *sockaddr, socklen_t addrlen)
+{
+	struct stream stream;
+	uint64_t deadline;
+	size_t size;
+	char *ubuffer;
+	int one = 1;
+	int ret;
+
+	histogram_reset(&client->rtt_ns);
+
+	stream.client = client;
+	stream.sockfd = client->sockfd;
+	stream.zerocopy = false;	// an echo is too small to pay off
+	stream.ninflight = 0;
+
+	stream.staging = client->staging;
+	if (stream.staging == NULL) {
+		stream.staging = staging_create(STAGING_DEFAULT_NCHUNK,
+				 		STAGING_DEFAULT_CHUNK_SIZE);
+		if (stream.staging == NULL) {
+			ERROR("failed to staging_create(): %s",
+	 		      staging_get_error());
+			goto RETURN_ERROR;
+		}
+	}
+
+	size = client->message_size;
+	if (size > client->size || size > staging_get_chunk_size(stream.staging)) {
+		ERROR("message of %zu bytes does not fit the buffers", size);
+		goto DESTROY_STAGING;
+	}
+
+	ubuffer = staging_get(stream.staging);
+
+	ret = connect(client->sockfd, sockaddr, addrlen);
+	if (ret == -1) {
+		ERROR("failed to connect(): %s", strerror(errno));
+		goto FREE_BUFFER;
+	}
+
+	// Nagle would hold back every message for the delayed ACK
+	ret = setsockopt(client->sockfd, IPPROTO_TCP, TCP_NODELAY,
+		  	 &one, sizeof(one));
+	if (ret == -1) {
+		ERROR("failed to setsockopt(TCP_NODELAY): %s", strerror(errno));
+		goto FREE_BUFFER;
+	}
+
+	deadline = 0;
+	if (client->duration > 0)
+		deadline = stats_now() + client->duration * 1000000000ULL;
+
+	for (int i = 0; deadline ? stats_now() < deadline
+				 : i < client->iterations; i++) {
+		uint64_t start = stats_now();
+
+		if (client->provider->memcpy_from(ubuffer, client->context,
+						  0, size) == -1) {
+			ERROR("failed to provider->memcpy_from(): %s",
+	 		      client->provider->get_error());
+			goto FREE_BUFFER;
+		}
+
+		if (client_send(&stream, ubuffer, size) == -1)
+			goto FREE_BUFFER;
+
+		if (client_recv_all(client->sockfd, ubuffer, size) == -1)
+			goto FREE_BUFFER;
+
+		if (client->provider->memcpy_to(client->context, ubuffer,
+						0, size) == -1) {
+			ERROR("failed to provider->memcpy_to(): %s",
+	 		      client->provider->get_error());
+			goto FREE_BUFFER;
 		}
 
-		sendlen += ret;
+		histogram_record(&client->rtt_ns, stats_now() - start);
 	}
 
-	close(clnt_fd);
-	free(ubuffer);
+	staging_put(stream.staging, ubuffer);
+	if (stream.staging != client->staging)
+		staging_destroy(stream.staging);
 
 	return 0;
 
-CLOSE_CLNT_FD:	close(clnt_fd);
-FREE_BUFFER:	free(ubuffer);
+FREE_BUFFER:	staging_put(stream.staging, ubuffer);
+DESTROY_STAGING:
+		if (stream.staging != client->staging)
+			staging_destroy(stream.staging);
 RETURN_ERROR:	return -1;
 }
 
+void client_get_rtt(Client client, struct histogram *rtt_ns)
+{
+	*rtt_ns = client->rtt_ns;
+}
+
+void client_get_zerocopy(Client client, struct client_zerocopy *zerocopy)
+{
+	*zerocopy = client->zerocopy_stats;
+}
 
 void client_cleanup(Client client)
 {
@@ -0,0 +1,297 @@
+#include "copy_engine.h"
+
+#include <stdio.h>	// BUFSIZ
+#include <stdbool.h>	// true, false
+#include <stdlib.h>	// malloc()
+#include <string.h>	// strerror()
+#include <errno.h>	// errno
+
+#include <pthread.h>	// pthread_create(), pthread_mutex_*(), pthread_cond_*()
+
+#include "memory_vector.h"
+
+#define ERROR(...) do {					\
+	snprintf(error, BUFSIZ, __VA_ARGS__);		\
+} while(false)
+
+struct copy {
+	bool to;
+	struct memory_vec vec;
+};
+
+// Requests are queued in ring order: fence N is requests[(N - 1) % depth]
+// and is done once completed >= N. The worker takes every queued request
+// going the same way at once and hands them to the provider as a batch.
+struct copy_engine {
+	struct memory_provider *provider;
+	Memory context;
+
+	int depth;
+	struct copy *requests;
+	struct memory_vec *vec;
+
+	CopyFence submitted;
+	CopyFence completed;
+	bool stopping;
+	bool failed;
+	char message[BUFSIZ];
+
+	pthread_t worker;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static __thread char error[BUFSIZ];
+
+static int copy_engine_run(CopyEngine engine, bool to,
+			   const struct memory_vec *vec, int count)
+{
+	if (to)
+		return memory_memcpy_to_v(engine->provider, engine->context,
+					  vec, count);
+	else
+		return memory_memcpy_from_v(engine->provider, engine->context,
+					    vec, count);
+}
+
+// Called with the lock held; the first failure sticks.
+static void copy_engine_fail(CopyEngine engine, bool to)
+{
+	if (engine->failed)
+		return;
+
+	snprintf(engine->message, BUFSIZ,
+		 "failed to memory_memcpy_%s_v(): %s",
+		 to ? "to" : "from", engine->provider->get_error());
+	engine->failed = true;
+}
+
+static void *copy_engine_work(void *arg)
+{
+	CopyEngine engine = arg;
+
+	pthread_mutex_lock(&engine->lock);
+	while (true) {
+		CopyFence first;
+		int count;
+		bool to;
+		int ret;
+
+		while (engine->completed == engine->submitted
+		       && !engine->stopping)
+			pthread_cond_wait(&engine->cond, &engine->lock);
+
+		if (engine->completed == engine->submitted)
+			break;
+
+		first = engine->completed;
+		to = engine->requests[first % engine->depth].to;
+		for (count = 0; first + count < engine->submitted; count++) {
+			struct copy *copy = &engine->requests[
+				(first + count) % engine->depth];
+
+			if (copy->to != to)
+				break;
+
+			engine->vec[count] = copy->vec;
+		}
+		pthread_mutex_unlock(&engine->lock);
+
+		ret = copy_engine_run(engine, to, engine->vec, count);
+
+		pthread_mutex_lock(&engine->lock);
+		if (ret == -1)
+			copy_engine_fail(engine, to);
+
+		engine->completed += count;
+		pthread_cond_broadcast(&engine->cond);
+	}
+	pthread_mutex_unlock(&engine->lock);
+
+	return NULL;
+}
+
+CopyEngine copy_engine_create(struct memory_provider *provider,
+			      Memory context, int depth)
+{
+	CopyEngine engine;
+
+	if (depth < 0) {
+		ERROR("invalid depth: %d", depth);
+		goto RETURN_NULL;
+	}
+
+	engine = malloc(sizeof(struct copy_engine));
+	if (engine == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto RETURN_NULL;
+	}
+
+	engine->provider = provider;
+	engine->context = context;
+	engine->depth = depth;
+	engine->requests = NULL;
+	engine->vec = NULL;
+
+	engine->submitted = engine->completed = 0;
+	engine->stopping = engine->failed = false;
+
+	pthread_mutex_init(&engine->lock, NULL);
+	pthread_cond_init(&engine->cond, NULL);
+
+	if (depth == 0)
+		return engine;
+
+	engine->requests = malloc(sizeof(struct copy) * depth);
+	if (engine->requests == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto DESTROY_LOCK;
+	}
+
+	engine->vec = malloc(sizeof(struct memory_vec) * depth);
+	if (engine->vec == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto FREE_REQUESTS;
+	}
+
+	if (pthread_create(&engine->worker, NULL, copy_engine_work, engine)) {
+		ERROR("failed to pthread_create()");
+		goto FREE_VEC;
+	}
+
+	return engine;
+
+FREE_VEC:	free(engine->vec);
+FREE_REQUESTS:	free(engine->requests);
+DESTROY_LOCK:	pthread_cond_destroy(&engine->cond);
+		pthread_mutex_destroy(&engine->lock);
+		free(engine);
+RETURN_NULL:	return NULL;
+}
+
+static CopyFence copy_engine_submit(CopyEngine engine, bool to,
+				    void *ptr, size_t offset, size_t len)
+{
+	struct memory_vec vec = { .offset = offset, .ptr = ptr, .len = len };
+	struct copy *copy;
+	CopyFence fence;
+
+	if (engine->depth == 0) {
+		int ret = copy_engine_run(engine, to, &vec, 1);
+
+		pthread_mutex_lock(&engine->lock);
+		if (ret == -1)
+			copy_engine_fail(engine, to);
+
+		fence = engine->completed = ++engine->submitted;
+		pthread_mutex_unlock(&engine->lock);
+
+		return fence;
+	}
+
+	pthread_mutex_lock(&engine->lock);
+	while (engine->submitted - engine->completed == engine->depth)
+		pthread_cond_wait(&engine->cond, &engine->lock);
+
+	copy = &engine->requests[engine->submitted % engine->depth];
+	copy->to = to;
+	copy->vec = vec;
+
+	fence = ++engine->submitted;
+	pthread_cond_broadcast(&engine->cond);
+	pthread_mutex_unlock(&engine->lock);
+
+	return fence;
+}
+
+CopyFence copy_engine_to(CopyEngine engine, void *src,
+			 size_t offset, size_t len)
+{
+	return copy_engine_submit(engine, true, src, offset, len);
+}
+
+CopyFence copy_engine_from(CopyEngine engine, void *dst,
+			   size_t offset, size_t len)
+{
+	return copy_engine_submit(engine, false, dst, offset, len);
+}
+
+int copy_engine_poll(CopyEngine engine, CopyFence fence)
+{
+	int ret;
+
+	pthread_mutex_lock(&engine->lock);
+	if (engine->failed) {
+		ERROR("%s", engine->message);
+		ret = -1;
+	} else {
+		ret = engine->completed >= fence;
+	}
+	pthread_mutex_unlock(&engine->lock);
+
+	return ret;
+}
+
+int copy_engine_wait(CopyEngine engine, CopyFence fence)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&engine->lock);
+	while (engine->completed < fence && !engine->failed)
+		pthread_cond_wait(&engine->cond, &engine->lock);
+
+	if (engine->failed) {
+		ERROR("%s", engine->message);
+		ret = -1;
+	}
+	pthread_mutex_unlock(&engine->lock);
+
+	return ret;
+}
+
+int copy_engine_wait_v(CopyEngine engine, const CopyFence *fences, int count)
+{
+	CopyFence last = 0;
+
+	// completion is in order: the latest fence covers the others
+	for (int i = 0; i < count; i++)
+		if (fences[i] > last)
+			last = fences[i];
+
+	return copy_engine_wait(engine, last);
+}
+
+int copy_engine_drain(CopyEngine engine)
+{
+	CopyFence fence;
+
+	pthread_mutex_lock(&engine->lock);
+	fence = engine->submitted;
+	pthread_mutex_unlock(&engine->lock);
+
+	return copy_engine_wait(engine, fence);
+}
+
+void copy_engine_destroy(CopyEngine engine)
+{
+	if (engine->depth > 0) {
+		pthread_mutex_lock(&engine->lock);
+		engine->stopping = true;
+		pthread_cond_broadcast(&engine->cond);
+		pthread_mutex_unlock(&engine->lock);
+
+		pthread_join(engine->worker, NULL);
+	}
+
+	pthread_cond_destroy(&engine->cond);
+	pthread_mutex_destroy(&engine->lock);
+
+	free(engine->vec);
+	free(engine->requests);
+	free(engine);
+}
+
+char *copy_engine_get_error(void)
+{
+	return error;
+}
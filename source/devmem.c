@@ -0,0 +1,145 @@
+#include "devmem.h"
+
+#include <stdio.h>	// BUFSIZ
+#include <stdbool.h>	// true, false
+#include <stdlib.h>	// malloc(), calloc()
+#include <string.h>	// strerror()
+#include <errno.h>	// errno
+
+#include <net/if.h>	// if_nametoindex()
+
+#include <linux/netdev.h>	// NETDEV_QUEUE_TYPE_RX
+
+#include "netdev-user.h"	// netdev_bind_rx()
+#include "ethtool-user.h"	// ethtool_rings_set()
+#include <ynl.h>		// ynl_sock_create()
+
+#define ERROR(...) do {					\
+	snprintf(error, BUFSIZ, __VA_ARGS__);		\
+} while(false)
+
+// Binding lives as long as the netlink socket: closing it unbinds.
+struct devmem {
+	struct ynl_sock *ys;
+	unsigned int ifindex;
+	unsigned int dmabuf_id;
+};
+
+static __thread char error[BUFSIZ];
+
+static int devmem_enable_headersplit(unsigned int ifindex)
+{
+	struct ethtool_rings_set_req *req;
+	struct ynl_error yerr;
+	struct ynl_sock *ys;
+	int ret;
+
+	ys = ynl_sock_create(&ynl_ethtool_family, &yerr);
+	if (ys == NULL) {
+		ERROR("failed to ynl_sock_create(): %s", yerr.msg);
+		return -1;
+	}
+
+	req = ethtool_rings_set_req_alloc();
+	ethtool_rings_set_req_set_header_dev_index(req, ifindex);
+	ethtool_rings_set_req_set_tcp_data_split(req, 2);	// on
+
+	ret = ethtool_rings_set(ys, req);
+	if (ret < 0)
+		ERROR("failed to ethtool_rings_set(): %s", ys->err.msg);
+
+	ethtool_rings_set_req_free(req);
+	ynl_sock_destroy(ys);
+
+	return ret < 0 ? -1 : 0;
+}
+
+Devmem devmem_bind_rx(const char *ifname, int dmabuf_fd,
+		      int start_queue, int num_queues)
+{
+	struct netdev_bind_rx_req *req;
+	struct netdev_bind_rx_rsp *rsp;
+	struct netdev_queue_id *queues;
+	struct ynl_error yerr;
+	Devmem devmem;
+
+	devmem = malloc(sizeof(struct devmem));
+	if (devmem == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto RETURN_NULL;
+	}
+
+	devmem->ifindex = if_nametoindex(ifname);
+	if (devmem->ifindex == 0) {
+		ERROR("failed to if_nametoindex(): %s", strerror(errno));
+		goto FREE_DEVMEM;
+	}
+
+	// the NIC refuses dmabuf queues unless headers are split off
+	if (devmem_enable_headersplit(devmem->ifindex) == -1)
+		goto FREE_DEVMEM;
+
+	queues = calloc(num_queues, sizeof(struct netdev_queue_id));
+	if (queues == NULL) {
+		ERROR("failed to calloc(): %s", strerror(errno));
+		goto FREE_DEVMEM;
+	}
+
+	for (int i = 0; i < num_queues; i++) {
+		queues[i]._present.type = 1;
+		queues[i]._present.id = 1;
+		queues[i].type = NETDEV_QUEUE_TYPE_RX;
+		queues[i].id = start_queue + i;
+	}
+
+	devmem->ys = ynl_sock_create(&ynl_netdev_family, &yerr);
+	if (devmem->ys == NULL) {
+		ERROR("failed to ynl_sock_create(): %s", yerr.msg);
+		free(queues);
+		goto FREE_DEVMEM;
+	}
+
+	req = netdev_bind_rx_req_alloc();
+	netdev_bind_rx_req_set_ifindex(req, devmem->ifindex);
+	netdev_bind_rx_req_set_fd(req, dmabuf_fd);
+	// the request takes ownership of queues
+	__netdev_bind_rx_req_set_queues(req, queues, num_queues);
+
+	rsp = netdev_bind_rx(devmem->ys, req);
+	netdev_bind_rx_req_free(req);
+	if (rsp == NULL) {
+		ERROR("failed to netdev_bind_rx(): %s", devmem->ys->err.msg);
+		goto DESTROY_YS;
+	}
+
+	if ( !rsp->_present.id ) {
+		ERROR("failed to netdev_bind_rx(): dmabuf id not present");
+		netdev_bind_rx_rsp_free(rsp);
+		goto DESTROY_YS;
+	}
+
+	devmem->dmabuf_id = rsp->id;
+	netdev_bind_rx_rsp_free(rsp);
+
+	return devmem;
+
+DESTROY_YS:	ynl_sock_destroy(devmem->ys);
+FREE_DEVMEM:	free(devmem);
+RETURN_NULL:	return NULL;
+}
+
+unsigned int devmem_get_id(Devmem devmem)
+{
+	return devmem->dmabuf_id;
+}
+
+void devmem_unbind(Devmem devmem)
+{
+	ynl_sock_destroy(devmem->ys);
+	free(devmem);
+}
+
+char *devmem_get_error(void)
+{
+	return error;
+}
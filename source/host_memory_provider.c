@@ -0,0 +1,209 @@
+#include "host_memory_provider.h"
+
+#include <stdio.h>	// BUFSIZ
+#include <stdbool.h>	// true, false
+#include <stdlib.h>	// malloc()
+#include <string.h>	// memcpy(), strerror()
+#include <errno.h>	// errno
+
+#include <sys/mman.h>	// mmap(), mlock(), MAP_HUGETLB
+
+#define HUGEPAGE_SIZE	(2 * 1024 * 1024)
+
+#define ERROR(...) do {					\
+	snprintf(error, BUFSIZ, __VA_ARGS__);		\
+} while(false)
+
+struct memory {
+	char *data;
+	size_t size;
+
+	size_t length;
+	bool locked;
+};
+
+static __thread char error[BUFSIZ];
+static int host_flags;
+
+static void *host_map(size_t length, int flags)
+{
+	void *mapping;
+
+	if (flags & HOST_MEMORY_HUGETLB) {
+		mapping = mmap(NULL, length, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+			       -1, 0);
+		if (mapping != MAP_FAILED)
+			return mapping;
+	}
+
+	mapping = mmap(NULL, length, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapping == MAP_FAILED)
+		return NULL;
+
+	if (flags & HOST_MEMORY_HUGETLB)
+		madvise(mapping, length, MADV_HUGEPAGE);
+
+	return mapping;
+}
+
+static Memory host_alloc_flags(size_t size, int flags)
+{
+	Memory memory;
+
+	if (size == 0) {
+		ERROR("invalid size: %zu", size);
+		goto RETURN_NULL;
+	}
+
+	memory = malloc(sizeof(struct memory));
+	if (memory == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto RETURN_NULL;
+	}
+
+	memory->size = size;
+	memory->length = size;
+	if (flags & HOST_MEMORY_HUGETLB)
+		memory->length = (size + HUGEPAGE_SIZE - 1)
+			       & ~((size_t) HUGEPAGE_SIZE - 1);
+
+	memory->data = host_map(memory->length, flags);
+	if (memory->data == NULL) {
+		ERROR("failed to mmap(): %s", strerror(errno));
+		goto FREE_MEMORY;
+	}
+
+	memory->locked = false;
+	if (flags & HOST_MEMORY_MLOCK) {
+		if (mlock(memory->data, memory->length) == -1) {
+			ERROR("failed to mlock(): %s", strerror(errno));
+			goto UNMAP_DATA;
+		}
+
+		memory->locked = true;
+	}
+
+	return memory;
+
+UNMAP_DATA:	munmap(memory->data, memory->length);
+FREE_MEMORY:	free(memory);
+RETURN_NULL:	return NULL;
+}
+
+static Memory host_alloc(size_t size)
+{
+	return host_alloc_flags(size, host_flags);
+}
+
+static Memory hugepage_alloc(size_t size)
+{
+	return host_alloc_flags(size, host_flags | HOST_MEMORY_HUGETLB);
+}
+
+static int host_free(Memory memory)
+{
+	if (memory->locked)
+		munlock(memory->data, memory->length);
+
+	if (munmap(memory->data, memory->length) == -1) {
+		ERROR("failed to munmap(): %s", strerror(errno));
+		return -1;
+	}
+
+	free(memory);
+
+	return 0;
+}
+
+static size_t host_get_size(Memory memory)
+{
+	return memory->size;
+}
+
+static int host_check_range(Memory memory, size_t offset, size_t len)
+{
+	if (offset > memory->size || len > memory->size - offset) {
+		ERROR("out of range: %zu + %zu > %zu",
+		      offset, len, memory->size);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int host_memcpy_to(Memory memory, void *src, size_t offset, size_t len)
+{
+	if (host_check_range(memory, offset, len) == -1)
+		return -1;
+
+	memcpy(memory->data + offset, src, len);
+
+	return len;
+}
+
+static int host_memcpy_from(void *dst, Memory memory,
+			    size_t offset, size_t len)
+{
+	if (host_check_range(memory, offset, len) == -1)
+		return -1;
+
+	memcpy(dst, memory->data + offset, len);
+
+	return len;
+}
+
+int host_memory_memcpy_to_v(Memory memory, const struct memory_vec *vec,
+			    int count)
+{
+	for (int i = 0; i < count; i++)
+		if (host_check_range(memory, vec[i].offset, vec[i].len) == -1)
+			return -1;
+
+	for (int i = 0; i < count; i++)
+		memcpy(memory->data + vec[i].offset, vec[i].ptr, vec[i].len);
+
+	return 0;
+}
+
+int host_memory_memcpy_from_v(Memory memory, const struct memory_vec *vec,
+			      int count)
+{
+	for (int i = 0; i < count; i++)
+		if (host_check_range(memory, vec[i].offset, vec[i].len) == -1)
+			return -1;
+
+	for (int i = 0; i < count; i++)
+		memcpy(vec[i].ptr, memory->data + vec[i].offset, vec[i].len);
+
+	return 0;
+}
+
+static char *host_get_error(void)
+{
+	return error;
+}
+
+void host_memory_provider_set_flags(int flags)
+{
+	host_flags = flags;
+}
+
+struct memory_provider host_memory_provider = {
+	.alloc = host_alloc,
+	.free = host_free,
+	.get_size = host_get_size,
+	.memcpy_to = host_memcpy_to,
+	.memcpy_from = host_memcpy_from,
+	.get_error = host_get_error
+};
+
+struct memory_provider hugepage_memory_provider = {
+	.alloc = hugepage_alloc,
+	.free = host_free,
+	.get_size = host_get_size,
+	.memcpy_to = host_memcpy_to,
+	.memcpy_from = host_memcpy_from,
+	.get_error = host_get_error
+};
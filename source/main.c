@@ -1,7 +1,15 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>		// fprintf(), BUFSIZ
 #include <stdbool.h>		// bool, true, false
 #include <stdlib.h>		// exit(), EXIT_FAILURE
 #include <string.h>		// strerror()
 #include <errno.h>		// errno
+#include <signal.h>		// signal(), sigwait(), SIGINT, SIGTERM
+
+#include <unistd.h>		// sysconf()
+#include <pthread.h>		// pthread_create(), pthread_join()
+#include <sched.h>		// cpu_set_t, CPU_SET()
 
 #include <arpa/inet.h>		// struct sockaddr_in
 
@@ -9,9 +17,16 @@
 #include "argument-parser.h"	// argument_parser...()
 #include "memory_provider.h"
 
+#include "memory_registry.h"
+#include "host_memory_provider.h"
+#include "udmabuf_memory_provider.h"
+
 #include "client.h"
+#include "staging.h"
+#include "stats.h"
 #include "socket.h"
 #include "server.h"
+#include "arena.h"
 
 #define ARRAY_SIZE(ARR) (sizeof(ARR) / sizeof(*(ARR)))
 #define ERROR(...) do {			\
@@ -30,17 +45,52 @@ struct {
 
 	int buffer_size;
 	bool server;
-
-	struct argument_info info[6];
+	bool sharded;
+	bool ring;
+	char *mode;
+
+	int chunk_count;
+	int chunk_size;
+
+	int report_interval;
+	int slice;
+
+	int rcvbuf;
+	int sndbuf;
+	int rcvlowat;
+	int notsent_lowat;
+	bool nodelay;
+	char *congestion;
+	bool autotune;
+	int bandwidth;
+
+	int busy_poll;
+	int busy_poll_budget;
+
+	bool zerocopy;
+	int streams;
+	int rate;
+	int duration;
+	int message_size;
+	int iterations;
+
+	char *provider;
+	bool mlock;
+
+	char *ifname;
+	int queue;
+	int queue_count;
+
+	struct argument_info info[34];
 } arguments = { .info = {
 	{
 		"bind-address", "a", "IP address to bind",
-		(ArgumentValue *) &arguments.address,
+		(ArgumentValue *) &arguments.bind_address,
 		ARGUMENT_PARSER_TYPE_STRING | ARGUMENT_PARSER_TYPE_MANDATORY
 	},
 	{
 		"bind-port", "p", "Port number to bind",
-		(ArgumentValue *) &arguments.port,
+		(ArgumentValue *) &arguments.bind_port,
 		ARGUMENT_PARSER_TYPE_INTEGER | ARGUMENT_PARSER_TYPE_MANDATORY
 	},
 	{
@@ -53,6 +103,154 @@ struct {
 		(ArgumentValue *) &arguments.server,
 		ARGUMENT_PARSER_TYPE_FLAG
 	},
+	{
+		"sharded", "S", "run one listener thread per core (server only)",
+		(ArgumentValue *) &arguments.sharded,
+		ARGUMENT_PARSER_TYPE_FLAG
+	},
+	{
+		"ring", "r", "wrap around each connection's slice (tcp server "
+			    "only)",
+		(ArgumentValue *) &arguments.ring,
+		ARGUMENT_PARSER_TYPE_FLAG
+	},
+	{
+		"mode", "m", "run mode: tcp (default), dma, uring, striped, "
+			    "pingpong",
+		(ArgumentValue *) &arguments.mode,
+		ARGUMENT_PARSER_TYPE_STRING
+	},
+	{
+		"chunk-count", "c", "Number of host staging chunks",
+		(ArgumentValue *) &arguments.chunk_count,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	},
+	{
+		"chunk-size", "C", "Size of a host staging chunk",
+		(ArgumentValue *) &arguments.chunk_size,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	},
+	{
+		"report-interval", "R", "Report server stats every N ms",
+		(ArgumentValue *) &arguments.report_interval,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	},
+	{
+		"slice", "x", "device memory per connection (server only, "
+			      "default: all of it)",
+		(ArgumentValue *) &arguments.slice,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	},
+	{
+		"rcvbuf", "w", "SO_RCVBUF of every socket",
+		(ArgumentValue *) &arguments.rcvbuf,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	},
+	{
+		"sndbuf", "W", "SO_SNDBUF of every socket",
+		(ArgumentValue *) &arguments.sndbuf,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	},
+	{
+		"rcvlowat", "l", "SO_RCVLOWAT of every socket",
+		(ArgumentValue *) &arguments.rcvlowat,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	},
+	{
+		"notsent-lowat", "L", "TCP_NOTSENT_LOWAT of every socket",
+		(ArgumentValue *) &arguments.notsent_lowat,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	},
+	{
+		"nodelay", "n", "set TCP_NODELAY",
+		(ArgumentValue *) &arguments.nodelay,
+		ARGUMENT_PARSER_TYPE_FLAG
+	},
+	{
+		"congestion", "g", "TCP congestion control algorithm",
+		(ArgumentValue *) &arguments.congestion,
+		ARGUMENT_PARSER_TYPE_STRING
+	},
+	{
+		"autotune", "t", "raise socket buffers to --bandwidth x the "
+			       "measured RTT",
+		(ArgumentValue *) &arguments.autotune,
+		ARGUMENT_PARSER_TYPE_FLAG
+	},
+	{
+		"bandwidth", "T", "configured (not measured) link bandwidth "
+				"in Mbit/s for --autotune",
+		(ArgumentValue *) &arguments.bandwidth,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	},
+	{
+		"busy-poll", "u", "busy poll for N usecs before sleeping",
+		(ArgumentValue *) &arguments.busy_poll,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	},
+	{
+		"busy-poll-budget", "U", "packets per busy poll round",
+		(ArgumentValue *) &arguments.busy_poll_budget,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	},
+	{
+		"zerocopy", "z", "send with MSG_ZEROCOPY",
+		(ArgumentValue *) &arguments.zerocopy,
+		ARGUMENT_PARSER_TYPE_FLAG
+	},
+	{
+		"streams", "N", "stripe the transfer over N connections",
+		(ArgumentValue *) &arguments.streams,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	},
+	{
+		"rate", "e", "cap the send rate (Mbit/s)",
+		(ArgumentValue *) &arguments.rate,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	},
+	{
+		"duration", "d", "keep sending for N seconds "
+				 "(receive with --ring)",
+		(ArgumentValue *) &arguments.duration,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	},
+	{
+		"message-size", "M", "pingpong message size in bytes",
+		(ArgumentValue *) &arguments.message_size,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	},
+	{
+		"iterations", "I", "pingpong round trips",
+		(ArgumentValue *) &arguments.iterations,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	},
+	{
+		"provider", "o", "memory provider: amdgpu (default), host, "
+				 "hugepage, udmabuf",
+		(ArgumentValue *) &arguments.provider,
+		ARGUMENT_PARSER_TYPE_STRING
+	},
+	{
+		"mlock", "k", "lock host memory in RAM",
+		(ArgumentValue *) &arguments.mlock,
+		ARGUMENT_PARSER_TYPE_FLAG
+	},
+	{
+		"ifname", "i", "bind the dmabuf to this device's RX queues "
+			      "(server only, needs a dmabuf provider)",
+		(ArgumentValue *) &arguments.ifname,
+		ARGUMENT_PARSER_TYPE_STRING
+	},
+	{
+		"queue", "q", "first RX queue to bind",
+		(ArgumentValue *) &arguments.queue,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	},
+	{
+		"queue-count", "Q", "number of RX queues to bind",
+		(ArgumentValue *) &arguments.queue_count,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	},
 	{
 		"address", "A", "IP address to connect",
 		(ArgumentValue *) &arguments.address,
@@ -65,8 +263,75 @@ struct {
 	}
 }};
 
+struct shard {
+	pthread_t tid;
+	int cpu;
+
+	Memory context;
+	size_t offset;
+	size_t size;
+	StagingPool staging;
+	Arena arena;
+
+	Server server;
+	pthread_barrier_t *ready;
+};
+
+static struct {
+	char *name;
+	int (*run)(Server );
+} server_modes[] = {
+	{ "tcp", server_run_as_tcp },
+	{ "dma", server_run_as_dma },
+	{ "uring", server_run_as_uring },
+	{ "striped", server_run_as_striped },
+	{ "pingpong", server_run_as_pingpong }
+};
+
+static struct {
+	char *name;
+	int (*run)(Client , struct sockaddr *, socklen_t );
+} client_modes[] = {
+	{ "tcp", client_run_as_tcp },
+	{ "uring", client_run_as_uring },
+	{ "pingpong", client_run_as_pingpong }
+};
+
+static struct memory_provider *provider;
+
+static struct socket_profile profile;
+
+static Server running_server;
+
+static void report_stats(const char *label, const struct stats *stats,
+			 void *arg)
+{
+	char description[BUFSIZ];
+
+	stats_describe(stats, description, sizeof(description));
+
+	if (arg != NULL)
+		INFO("shard %d %s: %s", *(int *) arg, label, description);
+	else
+		INFO("%s: %s", label, description);
+}
+
+static int shard_count(void)
+{
+	int nshard = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return nshard < 1 ? 1 : nshard;
+}
+
+static void stop_server(int signo)
+{
+	if (running_server != NULL)
+		server_stop(running_server);
+}
+
 static void parse_argument(int argc, char *argv[])
 {
+	const struct memory_registry_entry *entry;
 	ArgumentParser parser;
 
 	parser = argument_parser_create(argc, argv);
@@ -85,55 +350,358 @@ static void parse_argument(int argc, char *argv[])
 
 	INFO("buffer_size: %d", arguments.buffer_size);
 	INFO("server: %s", arguments.server ? "Server" : "Client");
+	INFO("sharded: %s", arguments.sharded ? "true" : "false");
+	INFO("ring: %s", arguments.ring ? "true" : "false");
+
+	if (arguments.slice < 0)
+		ERROR("--slice must be positive, not %d", arguments.slice);
+
+	// without a slice every client takes the server's whole part
+	if (arguments.server && arguments.slice == 0)
+		INFO("slice: all of the buffer, one client at a time");
+	else if (arguments.server)
+		INFO("slice: %d bytes per client", arguments.slice);
+
+	// a client stripes over tcp connections of its own
+	if (arguments.streams > 1 && arguments.mode != NULL
+	 && strcmp(arguments.mode, "striped"))
+		ERROR("--streams stripes the transfer: drop --mode %s",
+		      arguments.mode);
+
+	if (arguments.mode == NULL)
+		arguments.mode = arguments.streams > 1 ? "striped" : "tcp";
+
+	INFO("mode: %s", arguments.mode);
+
+	// SO_REUSEPORT would spread the stripes of one transfer over shards
+	if (arguments.server && arguments.sharded
+	 && !strcmp(arguments.mode, "striped"))
+		ERROR("--mode striped reassembles on one listener: drop "
+		      "--sharded");
+
+	// only the epoll loop hands ring data to a consumer
+	if (arguments.ring && strcmp(arguments.mode, "tcp"))
+		ERROR("--ring needs --mode tcp, not %s", arguments.mode);
+
+	if (arguments.provider == NULL)
+		arguments.provider = (char *) memory_registry_get(0)->name;
+
+	entry = memory_registry_find(arguments.provider);
+	if (entry == NULL)
+		ERROR("unknown memory provider: %s", arguments.provider);
+
+	provider = entry->provider;
+	host_memory_provider_set_flags(arguments.mlock ? HOST_MEMORY_MLOCK
+				       		       : 0);
+
+	INFO("provider: %s (%s)", entry->name, entry->description);
+
+	if (arguments.ifname != NULL) {
+		if ( !entry->dmabuf )
+			ERROR("--ifname needs a dmabuf provider, not %s",
+	 		      entry->name);
+
+		if (arguments.sharded)
+			ERROR("--ifname binds one listener: drop --sharded");
+
+		if (arguments.queue_count <= 0)
+			arguments.queue_count = 1;
+
+		INFO("devmem: %s queue %d-%d", arguments.ifname,
+		     arguments.queue,
+		     arguments.queue + arguments.queue_count - 1);
+	}
+
+	if (arguments.chunk_count <= 0)
+		arguments.chunk_count = STAGING_DEFAULT_NCHUNK;
+
+	if (arguments.chunk_size <= 0)
+		arguments.chunk_size = STAGING_DEFAULT_CHUNK_SIZE;
+
+	// shards share the pool, and a dma shard holds its chunks per client
+	if (arguments.server && arguments.sharded
+	 && arguments.chunk_count < shard_count() * SERVER_COPY_DEPTH)
+		arguments.chunk_count = shard_count() * SERVER_COPY_DEPTH;
+
+	INFO("staging: %d x %d bytes",
+      	     arguments.chunk_count, arguments.chunk_size);
+
+	profile.rcvbuf = arguments.rcvbuf;
+	profile.sndbuf = arguments.sndbuf;
+	profile.rcvlowat = arguments.rcvlowat;
+	profile.notsent_lowat = arguments.notsent_lowat;
+	profile.nodelay = arguments.nodelay;
+	profile.congestion = arguments.congestion;
+	profile.autotune = arguments.autotune;
+	profile.bandwidth = arguments.bandwidth * 1000000LL;
+	profile.busy_poll = arguments.busy_poll;
+	profile.busy_poll_budget = arguments.busy_poll_budget;
+
+	if (profile.busy_poll)
+		INFO("busy-poll: %d us, budget %d",
+		     profile.busy_poll, profile.busy_poll_budget);
+
+	if (profile.autotune)
+		INFO("autotune: %lld bit/s configured", profile.bandwidth
+	     				     ? profile.bandwidth
+	     				     : SOCKET_DEFAULT_BANDWIDTH);
 
 	if (!arguments.server) {
 		INFO("connect-address: %s", arguments.address);
 		INFO("connect-port: %d", arguments.port);
+		INFO("zerocopy: %s", arguments.zerocopy ? "true" : "false");
+		INFO("streams: %d", arguments.streams > 1 ? arguments.streams : 1);
+		if (arguments.rate > 0)
+			INFO("rate: %d Mbit/s", arguments.rate);
+		if (arguments.duration > 0)
+			INFO("duration: %d s", arguments.duration);
 	}
 
 	argument_parser_destroy(parser);
 }
 
-static void do_server(int sockfd, Memory context)
+static void run_server(Server server)
+{
+	for (int i = 0; i < ARRAY_SIZE(server_modes); i++) {
+		if (strcmp(arguments.mode, server_modes[i].name))
+			continue;
+
+		if (server_modes[i].run(server) == -1)
+			ERROR("failed to server_run_as_%s(): %s",
+	 		      server_modes[i].name, server_get_error());
+
+		return;
+	}
+
+	ERROR("unknown server mode: %s", arguments.mode);
+}
+
+static void do_server(int sockfd, Memory context, StagingPool staging)
 {
 	Server server;
 
-	server = server_setup(sockfd, context);
+	server = server_setup(sockfd, provider, context, 0,
+		       	      provider->get_size(context));
 	if (server == NULL)
 		ERROR("failed to server_setup(): %s", server_get_error());
 
-	if (server_run_as_tcp(server) == -1)
-		ERROR("failed to server_run_as_tcp(): %s", server_get_error());
+	server_set_staging(server, staging);
+	server_set_profile(server, &profile);
+	server_set_busy_poll(server, arguments.busy_poll,
+		      	     arguments.busy_poll_budget);
+	server_set_report(server, report_stats, NULL, arguments.report_interval);
+	if (arguments.slice > 0
+	 && server_set_slice(server, arguments.slice) == -1)
+		ERROR("failed to server_set_slice(): %s", server_get_error());
+	if (arguments.ring)
+		server_set_ring(server, NULL, NULL);
+
+	// without devmem the dma mode still runs, on the copy path
+	if (arguments.ifname != NULL
+	 && server_bind_devmem(server, arguments.ifname,
+			       udmabuf_memory_get_fd(context),
+			       udmabuf_memory_get_offset(context),
+			       arguments.queue, arguments.queue_count) == -1)
+		WARN("failed to server_bind_devmem(): %s, falling back to "
+		     "copies", server_get_error());
+
+	running_server = server;
+	signal(SIGINT, stop_server);
+	signal(SIGTERM, stop_server);
+
+	run_server(server);
+
+	running_server = NULL;
 
 	server_cleanup(server);
 }
 
-static void do_client(int sockfd, Memory context)
+static void *run_shard(void *arg)
 {
-	Client client;
+	struct shard *shard = arg;
+	cpu_set_t cpuset;
+	int sockfd;
+
+	CPU_ZERO(&cpuset);
+	CPU_SET(shard->cpu, &cpuset);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+			    	   &cpuset) != 0)
+		WARN("failed to pin shard to cpu %d", shard->cpu);
+
+	sockfd = socket_create(arguments.bind_address, arguments.bind_port);
+	if (sockfd == -1)
+		ERROR("failed to socket_create(): %s", socket_get_error());
+
+	if (socket_tune(sockfd, &profile) == -1)
+		ERROR("failed to socket_tune(): %s", socket_get_error());
+
+	shard->server = server_setup(sockfd, provider, shard->context,
+			      	     shard->offset, shard->size);
+	if (shard->server == NULL)
+		ERROR("failed to server_setup(): %s", server_get_error());
+
+	server_set_staging(shard->server, shard->staging);
+	server_set_profile(shard->server, &profile);
+	server_set_busy_poll(shard->server, arguments.busy_poll,
+		      	     arguments.busy_poll_budget);
+	server_set_report(shard->server, report_stats, &shard->cpu,
+		   	  arguments.report_interval);
+	server_set_arena(shard->server, shard->arena);
+	if (arguments.slice > 0
+	 && server_set_slice(shard->server, arguments.slice) == -1)
+		ERROR("failed to server_set_slice(): %s", server_get_error());
+	if (arguments.ring)
+		server_set_ring(shard->server, NULL, NULL);
+
+	pthread_barrier_wait(shard->ready);
+
+	run_server(shard->server);
+
+	server_cleanup(shard->server);
+	socket_destroy(sockfd);
+
+	return NULL;
+}
+
+static void do_sharded_server(Memory context, StagingPool staging)
+{
+	pthread_barrier_t ready;
+	struct shard *shards;
+	sigset_t sigset;
+	Arena arena;
+	size_t slice;
+	int nshard;
+	int signo;
+
+	nshard = shard_count();
+
+	// every shard's part has to hold at least one slice
+	if (provider->get_size(context) / nshard < SERVER_SLICE_ALIGN)
+		ERROR("%zu bytes split over %d shards leave less than %d per "
+		      "shard: raise --buffer-size or drop --sharded",
+		      provider->get_size(context), nshard, SERVER_SLICE_ALIGN);
+
+	shards = malloc(sizeof(struct shard) * nshard);
+	if (shards == NULL)
+		ERROR("failed to malloc(): %s", strerror(errno));
+
+	// shards inherit the mask, so only sigwait() below sees the signal
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGINT);
+	sigaddset(&sigset, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+	pthread_barrier_init(&ready, NULL, nshard + 1);
+
+	// connections of every shard draw from the whole context
+	arena = arena_create(0, provider->get_size(context),
+		      	     SERVER_SLICE_ALIGN);
+	if (arena == NULL)
+		ERROR("failed to arena_create(): %s", arena_get_error());
+
+	slice = provider->get_size(context) / nshard;
+	for (int i = 0; i < nshard; i++) {
+		shards[i].cpu = i;
+		shards[i].context = context;
+		shards[i].offset = slice * i;
+		shards[i].size = slice;
+		shards[i].staging = staging;
+		shards[i].arena = arena;
+		shards[i].ready = &ready;
+
+		if (pthread_create(&shards[i].tid, NULL, run_shard, shards + i))
+			ERROR("failed to pthread_create()");
+	}
+
+	pthread_barrier_wait(&ready);
+	INFO("%d shards are listening", nshard);
+
+	sigwait(&sigset, &signo);
+
+	for (int i = 0; i < nshard; i++)
+		server_stop(shards[i].server);
+
+	for (int i = 0; i < nshard; i++)
+		pthread_join(shards[i].tid, NULL);
+
+	pthread_barrier_destroy(&ready);
+	arena_destroy(arena);
+	free(shards);
+}
+
+static void run_client(Client client,
+		       struct sockaddr *sockaddr, socklen_t addrlen)
+{
+	for (int i = 0; i < ARRAY_SIZE(client_modes); i++) {
+		if (strcmp(arguments.mode, client_modes[i].name))
+			continue;
+
+		if (client_modes[i].run(client, sockaddr, addrlen) == -1)
+			ERROR("failed to client_run_as_%s(): %s",
+	 		      client_modes[i].name, client_get_error());
+
+		return;
+	}
+
+	ERROR("unknown client mode: %s", arguments.mode);
+}
+
+static void do_client(int sockfd, Memory context, StagingPool staging)
+{
+	struct client_zerocopy zerocopy;
+	struct histogram rtt_ns;
 	struct sockaddr_in sockaddr;
-	socklen_t addrlen;
+	Client client;
 
-	client = client_setup(sockfd, context);
+	client = client_setup(sockfd, provider, context);
 	if (client == NULL)
 		ERROR("failed to client_setup(): %s", client_get_error());
 
+	client_set_staging(client, staging);
+	client_set_profile(client, &profile);
+	client_set_zerocopy(client, arguments.zerocopy);
+	client_set_pacing(client, arguments.rate * 1000000LL,
+		   	  arguments.duration);
+	client_set_pingpong(client, arguments.message_size,
+		     	    arguments.iterations);
+
 	memset(&sockaddr, 0x00, sizeof(struct sockaddr_in));
 	sockaddr.sin_family = AF_INET;
 	sockaddr.sin_addr.s_addr = inet_addr(arguments.address);
 	sockaddr.sin_port = htons(arguments.port);
 
-	if (client_run_as_tcp(client, (struct sockaddr *) &sockaddr,
-		       	      sizeof(struct sockaddr_in)) == -1)
-		ERROR("failed to client_run_as_tcp(): %s", client_get_error());
+	if (arguments.streams > 1) {
+		if (client_run_as_striped(client, (struct sockaddr *) &sockaddr,
+			   		  sizeof(struct sockaddr_in),
+			   		  arguments.streams) == -1)
+			ERROR("failed to client_run_as_striped(): %s",
+	 		      client_get_error());
+	} else {
+		run_client(client, (struct sockaddr *) &sockaddr,
+	     		   sizeof(struct sockaddr_in));
+	}
+
+	client_get_rtt(client, &rtt_ns);
+	if (rtt_ns.count > 0) {
+		char description[BUFSIZ];
+
+		histogram_describe(&rtt_ns, description, sizeof(description));
+		INFO("rtt: %s", description);
+	}
+
+	client_get_zerocopy(client, &zerocopy);
+	if (zerocopy.sends > 0)
+		INFO("zerocopy: %zu sends, %zu zerocopied, %zu copied (%.1f%%)",
+		     zerocopy.sends, zerocopy.zerocopied, zerocopy.copied,
+		     100.0 * zerocopy.zerocopied
+		     / (zerocopy.zerocopied + zerocopy.copied));
 
 	client_cleanup(client);
 }
 
 int main(int argc, char *argv[])
 {
-	struct memory_provider *provider;
-
+	StagingPool staging;
 	Memory context;
 	int sockfd;
 
@@ -145,28 +713,44 @@ int main(int argc, char *argv[])
 
 	parse_argument(argc, argv);
 
-	sockfd = socket_create(arguments.bind_address, arguments.bind_port);
-	if (sockfd == -1)
-		ERROR("failed to socket_create(): %s", socket_get_error());
-
-	provider = &amdgpu_memory_provider;
+	sockfd = -1;
+	if ( !(arguments.server && arguments.sharded) ) {
+		sockfd = socket_create(arguments.bind_address,
+			 	       arguments.bind_port);
+		if (sockfd == -1)
+			ERROR("failed to socket_create(): %s",
+	 		      socket_get_error());
+
+		if (socket_tune(sockfd, &profile) == -1)
+			ERROR("failed to socket_tune(): %s",
+	 		      socket_get_error());
+	}
 
 	context = provider->alloc(arguments.buffer_size);
 	if (context == NULL)
-		ERROR("failed to amdgpu_memory_provider->alloc(): %s",
+		ERROR("failed to provider->alloc(): %s",
 		      provider->get_error());
 
-	if (arguments.server) {
-		do_server(sockfd, context);
+	staging = staging_create(arguments.chunk_count, arguments.chunk_size);
+	if (staging == NULL)
+		ERROR("failed to staging_create(): %s", staging_get_error());
+
+	if (arguments.server && arguments.sharded) {
+		do_sharded_server(context, staging);
+	} else if (arguments.server) {
+		do_server(sockfd, context, staging);
 	} else {
-		do_client();
+		do_client(sockfd, context, staging);
 	}
 
+	staging_destroy(staging);
+
 	if (provider->free(context) == -1)
-		ERROR("failed to amdgpu_memory_provider->free(): %s",
+		ERROR("failed to provider->free(): %s",
 		      provider->get_error());
 
-	socket_destroy(sockfd);
+	if (sockfd != -1)
+		socket_destroy(sockfd);
 
 	logger_destroy();
 
@@ -0,0 +1,60 @@
+#include "memory_registry.h"
+
+#include <stddef.h>	// NULL
+#include <string.h>	// strcmp()
+
+#include "host_memory_provider.h"
+#include "udmabuf_memory_provider.h"
+
+#define ARRAY_SIZE(ARR) (sizeof(ARR) / sizeof(*(ARR)))
+
+// The first entry is the default.
+static const struct memory_registry_entry entries[] = {
+	{
+		"amdgpu", "VRAM of the AMD GPU",
+		&amdgpu_memory_provider, false,
+		NULL, NULL
+	},
+	{
+		"host", "anonymous host memory",
+		&host_memory_provider, false,
+		host_memory_memcpy_to_v, host_memory_memcpy_from_v
+	},
+	{
+		"hugepage", "host memory on hugepages",
+		&hugepage_memory_provider, false,
+		host_memory_memcpy_to_v, host_memory_memcpy_from_v
+	},
+	{
+		"udmabuf", "memfd exported as a dmabuf by /dev/udmabuf",
+		&udmabuf_memory_provider, true,
+		udmabuf_memory_memcpy_to_v, udmabuf_memory_memcpy_from_v
+	}
+};
+
+const struct memory_registry_entry *memory_registry_find(const char *name)
+{
+	for (int i = 0; i < ARRAY_SIZE(entries); i++)
+		if ( !strcmp(entries[i].name, name) )
+			return &entries[i];
+
+	return NULL;
+}
+
+const struct memory_registry_entry *memory_registry_lookup(
+	struct memory_provider *provider
+) {
+	for (int i = 0; i < ARRAY_SIZE(entries); i++)
+		if (entries[i].provider == provider)
+			return &entries[i];
+
+	return NULL;
+}
+
+const struct memory_registry_entry *memory_registry_get(int index)
+{
+	if (index < 0 || index >= ARRAY_SIZE(entries))
+		return NULL;
+
+	return &entries[index];
+}
@@ -0,0 +1,41 @@
+#include "memory_vector.h"
+
+#include <stddef.h>	// NULL
+
+#include "memory_registry.h"
+
+// struct memory_provider belongs to the provider library, so batched
+// entry points are looked up in the registry instead of the vtable.
+int memory_memcpy_to_v(struct memory_provider *provider, Memory memory,
+		       const struct memory_vec *vec, int count)
+{
+	const struct memory_registry_entry *entry;
+
+	entry = memory_registry_lookup(provider);
+	if (entry != NULL && entry->memcpy_to_v != NULL)
+		return entry->memcpy_to_v(memory, vec, count);
+
+	for (int i = 0; i < count; i++)
+		if (provider->memcpy_to(memory, vec[i].ptr,
+			  		vec[i].offset, vec[i].len) == -1)
+			return -1;
+
+	return 0;
+}
+
+int memory_memcpy_from_v(struct memory_provider *provider, Memory memory,
+			 const struct memory_vec *vec, int count)
+{
+	const struct memory_registry_entry *entry;
+
+	entry = memory_registry_lookup(provider);
+	if (entry != NULL && entry->memcpy_from_v != NULL)
+		return entry->memcpy_from_v(memory, vec, count);
+
+	for (int i = 0; i < count; i++)
+		if (provider->memcpy_from(vec[i].ptr, memory,
+			    		  vec[i].offset, vec[i].len) == -1)
+			return -1;
+
+	return 0;
+}
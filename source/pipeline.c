@@ -0,0 +1,426 @@
+#include "pipeline.h"
+
+#include <stdio.h>	// BUFSIZ
+#include <stdbool.h>	// true, false
+#include <stdlib.h>	// malloc()
+#include <string.h>	// strerror()
+#include <errno.h>	// errno
+
+#include <pthread.h>	// pthread_create(), pthread_mutex_*(), pthread_cond_*()
+
+#include "memory_provider.h"
+#include "memory_vector.h"
+#include "staging.h"
+#include "ring.h"
+#include "stats.h"
+
+#define ERROR(...) do {					\
+	snprintf(error, BUFSIZ, __VA_ARGS__);		\
+} while(false)
+
+struct staging {
+	char *buffer;
+	size_t offset;
+	size_t len;
+	Ring ring;
+};
+
+// Slots are used strictly in ring order: the producer fills slot
+// (head % nbuffer), the consumer drains slot (tail % nbuffer). Each
+// slot borrows a chunk from the staging pool only while it is in use.
+//
+// A writer's producer is the caller and its consumer the copy thread,
+// which copies whatever was submitted meanwhile into device memory as a
+// single batch. A reader is the other way around:
+// the copy thread reads [next_offset, end) ahead into chunks and the
+// caller takes them, along with ownership of the chunk.
+struct pipeline {
+	struct memory_provider *provider;
+	Memory context;
+	StagingPool pool;
+
+	bool reader;
+	size_t next_offset;
+	size_t end;
+	bool done;
+
+	int nbuffer;
+	struct staging *slots;
+	struct memory_vec *vec;
+
+	size_t head;
+	size_t tail;
+	bool stopping;
+	bool failed;
+	char message[BUFSIZ];
+
+	struct histogram copy_ns;
+
+	pthread_t copier;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static __thread char error[BUFSIZ];
+
+static void *pipeline_copy(void *arg)
+{
+	Pipeline pipeline = arg;
+
+	pthread_mutex_lock(&pipeline->lock);
+	while (true) {
+		uint64_t elapsed;
+		size_t tail;
+		int count;
+		int ret;
+
+		while (pipeline->tail == pipeline->head && !pipeline->stopping)
+			pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+
+		if (pipeline->tail == pipeline->head)
+			break;
+
+		// everything submitted so far goes down in one batch
+		tail = pipeline->tail;
+		count = pipeline->head - tail;
+		pthread_mutex_unlock(&pipeline->lock);
+
+		for (int i = 0; i < count; i++) {
+			struct staging *slot = &pipeline->slots[
+				(tail + i) % pipeline->nbuffer];
+
+			pipeline->vec[i].offset = slot->offset;
+			pipeline->vec[i].ptr = slot->buffer;
+			pipeline->vec[i].len = slot->len;
+		}
+
+		elapsed = stats_now();
+		ret = memory_memcpy_to_v(pipeline->provider, pipeline->context,
+					 pipeline->vec, count);
+		elapsed = stats_now() - elapsed;
+
+		for (int i = 0; i < count; i++) {
+			struct staging *slot = &pipeline->slots[
+				(tail + i) % pipeline->nbuffer];
+
+			staging_put(pipeline->pool, slot->buffer);
+
+			// only now may a consumer see the bytes
+			if (ret != -1 && slot->ring != NULL)
+				ring_commit(slot->ring, slot->len);
+		}
+
+		pthread_mutex_lock(&pipeline->lock);
+		for (int i = 0; i < count; i++)
+			pipeline->slots[(tail + i) % pipeline->nbuffer].buffer
+				= NULL;
+
+		histogram_record(&pipeline->copy_ns, elapsed);
+		if (ret == -1 && !pipeline->failed) {
+			snprintf(pipeline->message, BUFSIZ,
+	    			 "failed to memory_memcpy_to_v(): %s",
+	    			 pipeline->provider->get_error());
+			pipeline->failed = true;
+		}
+
+		pipeline->tail += count;
+		pthread_cond_broadcast(&pipeline->cond);
+	}
+	pthread_mutex_unlock(&pipeline->lock);
+
+	return NULL;
+}
+
+static void *pipeline_read(void *arg)
+{
+	Pipeline pipeline = arg;
+	size_t chunk_size = staging_get_chunk_size(pipeline->pool);
+
+	pthread_mutex_lock(&pipeline->lock);
+	while (true) {
+		struct staging *slot;
+		uint64_t elapsed;
+		size_t offset;
+		size_t len;
+		char *buffer;
+		int ret;
+
+		while (pipeline->head - pipeline->tail == pipeline->nbuffer
+		       && !pipeline->stopping)
+			pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+
+		if (pipeline->stopping
+		 || pipeline->next_offset == pipeline->end)
+			break;
+
+		offset = pipeline->next_offset;
+		len = pipeline->end - offset;
+		if (len > chunk_size)
+			len = chunk_size;
+		pipeline->next_offset += len;
+		pthread_mutex_unlock(&pipeline->lock);
+
+		buffer = staging_get(pipeline->pool);
+
+		elapsed = stats_now();
+		ret = pipeline->provider->memcpy_from(
+			buffer, pipeline->context, offset, len
+		);
+		elapsed = stats_now() - elapsed;
+
+		pthread_mutex_lock(&pipeline->lock);
+		histogram_record(&pipeline->copy_ns, elapsed);
+		if (ret == -1) {
+			staging_put(pipeline->pool, buffer);
+			snprintf(pipeline->message, BUFSIZ,
+	    			 "failed to provider->memcpy_from(): %s",
+	    			 pipeline->provider->get_error());
+			pipeline->failed = true;
+			break;
+		}
+
+		slot = &pipeline->slots[pipeline->head % pipeline->nbuffer];
+		slot->buffer = buffer;
+		slot->offset = offset;
+		slot->len = len;
+
+		pipeline->head++;
+		pthread_cond_broadcast(&pipeline->cond);
+	}
+
+	pipeline->done = true;
+	pthread_cond_broadcast(&pipeline->cond);
+	pthread_mutex_unlock(&pipeline->lock);
+
+	return NULL;
+}
+
+static Pipeline pipeline_start(struct memory_provider *provider,
+			       Memory context, StagingPool pool, int nbuffer,
+			       size_t offset, size_t len,
+			       void *(*copier)(void *))
+{
+	Pipeline pipeline;
+
+	pipeline = malloc(sizeof(struct pipeline));
+	if (pipeline == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto RETURN_NULL;
+	}
+
+	pipeline->slots = malloc(sizeof(struct staging) * nbuffer);
+	if (pipeline->slots == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto FREE_PIPELINE;
+	}
+
+	pipeline->vec = malloc(sizeof(struct memory_vec) * nbuffer);
+	if (pipeline->vec == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto FREE_SLOTS;
+	}
+
+	for (int i = 0; i < nbuffer; i++)
+		pipeline->slots[i].buffer = NULL;
+
+	pipeline->provider = provider;
+	pipeline->context = context;
+	pipeline->pool = pool;
+	pipeline->reader = copier == pipeline_read;
+	pipeline->next_offset = offset;
+	pipeline->end = offset + len;
+	pipeline->done = false;
+	pipeline->nbuffer = nbuffer;
+	pipeline->head = pipeline->tail = 0;
+	pipeline->stopping = pipeline->failed = false;
+	histogram_reset(&pipeline->copy_ns);
+
+	pthread_mutex_init(&pipeline->lock, NULL);
+	pthread_cond_init(&pipeline->cond, NULL);
+
+	if (pthread_create(&pipeline->copier, NULL, copier, pipeline)) {
+		ERROR("failed to pthread_create()");
+		goto DESTROY_LOCK;
+	}
+
+	return pipeline;
+
+DESTROY_LOCK:	pthread_cond_destroy(&pipeline->cond);
+		pthread_mutex_destroy(&pipeline->lock);
+		free(pipeline->vec);
+FREE_SLOTS:	free(pipeline->slots);
+FREE_PIPELINE:	free(pipeline);
+RETURN_NULL:	return NULL;
+}
+
+Pipeline pipeline_create(struct memory_provider *provider, Memory context,
+			 StagingPool pool, int nbuffer)
+{
+	return pipeline_start(provider, context, pool, nbuffer, 0, 0,
+			      pipeline_copy);
+}
+
+Pipeline pipeline_create_reader(struct memory_provider *provider,
+				Memory context, StagingPool pool,
+				int nbuffer, size_t offset, size_t len)
+{
+	return pipeline_start(provider, context, pool, nbuffer, offset, len,
+		       	      pipeline_read);
+}
+
+void *pipeline_acquire(Pipeline pipeline)
+{
+	struct staging *slot;
+
+	pthread_mutex_lock(&pipeline->lock);
+	while (pipeline->head - pipeline->tail == pipeline->nbuffer)
+		pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+
+	slot = &pipeline->slots[pipeline->head % pipeline->nbuffer];
+	pthread_mutex_unlock(&pipeline->lock);
+
+	// a chunk acquired but never submitted is kept for the next call
+	if (slot->buffer == NULL)
+		slot->buffer = staging_get(pipeline->pool);
+
+	return slot->buffer;
+}
+
+int pipeline_submit(Pipeline pipeline, size_t offset, size_t len, Ring ring)
+{
+	struct staging *slot;
+
+	pthread_mutex_lock(&pipeline->lock);
+	if (pipeline->failed) {
+		ERROR("%s", pipeline->message);
+		pthread_mutex_unlock(&pipeline->lock);
+		return -1;
+	}
+
+	slot = &pipeline->slots[pipeline->head % pipeline->nbuffer];
+	slot->offset = offset;
+	slot->len = len;
+	slot->ring = ring;
+
+	pipeline->head++;
+	pthread_cond_broadcast(&pipeline->cond);
+	pthread_mutex_unlock(&pipeline->lock);
+
+	return 0;
+}
+
+void pipeline_release(Pipeline pipeline)
+{
+	struct staging *slot;
+
+	pthread_mutex_lock(&pipeline->lock);
+	slot = &pipeline->slots[pipeline->head % pipeline->nbuffer];
+	pthread_mutex_unlock(&pipeline->lock);
+
+	if (slot->buffer != NULL) {
+		staging_put(pipeline->pool, slot->buffer);
+		slot->buffer = NULL;
+	}
+}
+
+int pipeline_flush(Pipeline pipeline)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&pipeline->lock);
+	while (pipeline->tail != pipeline->head)
+		pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+
+	if (pipeline->failed) {
+		ERROR("%s", pipeline->message);
+		ret = -1;
+	}
+	pthread_mutex_unlock(&pipeline->lock);
+
+	return ret;
+}
+
+ssize_t pipeline_next(Pipeline pipeline, void **chunk, size_t *offset)
+{
+	struct staging *slot;
+	ssize_t len;
+
+	pthread_mutex_lock(&pipeline->lock);
+	while (pipeline->tail == pipeline->head && !pipeline->done)
+		pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+
+	if (pipeline->failed) {
+		ERROR("%s", pipeline->message);
+		pthread_mutex_unlock(&pipeline->lock);
+		return -1;
+	}
+
+	if (pipeline->tail == pipeline->head) {
+		pthread_mutex_unlock(&pipeline->lock);
+		return 0;
+	}
+
+	slot = &pipeline->slots[pipeline->tail % pipeline->nbuffer];
+	*chunk = slot->buffer;
+	*offset = slot->offset;
+	len = slot->len;
+	slot->buffer = NULL;
+
+	pipeline->tail++;
+	pthread_cond_broadcast(&pipeline->cond);
+	pthread_mutex_unlock(&pipeline->lock);
+
+	return len;
+}
+
+void pipeline_take_copy_ns(Pipeline pipeline, struct histogram *histogram)
+{
+	pthread_mutex_lock(&pipeline->lock);
+	histogram_merge(histogram, &pipeline->copy_ns);
+	histogram_reset(&pipeline->copy_ns);
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+size_t pipeline_get_bufsize(Pipeline pipeline)
+{
+	return staging_get_chunk_size(pipeline->pool);
+}
+
+void pipeline_destroy(Pipeline pipeline)
+{
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->stopping = true;
+
+	// chunks read ahead will never be taken; hand them back in case
+	// the copy thread is waiting in staging_get() for one of them
+	if (pipeline->reader) {
+		for (; pipeline->tail != pipeline->head; pipeline->tail++) {
+			struct staging *slot = &pipeline->slots[
+				pipeline->tail % pipeline->nbuffer];
+
+			staging_put(pipeline->pool, slot->buffer);
+			slot->buffer = NULL;
+		}
+	}
+
+	pthread_cond_broadcast(&pipeline->cond);
+	pthread_mutex_unlock(&pipeline->lock);
+
+	pthread_join(pipeline->copier, NULL);
+
+	pthread_cond_destroy(&pipeline->cond);
+	pthread_mutex_destroy(&pipeline->lock);
+
+	for (int i = 0; i < pipeline->nbuffer; i++)
+		if (pipeline->slots[i].buffer != NULL)
+			staging_put(pipeline->pool, pipeline->slots[i].buffer);
+
+	free(pipeline->vec);
+	free(pipeline->slots);
+	free(pipeline);
+}
+
+char *pipeline_get_error(void)
+{
+	return error;
+}
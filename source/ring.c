@@ -0,0 +1,122 @@
+#include "ring.h"
+
+#include <stdio.h>	// BUFSIZ
+#include <stdbool.h>	// true, false
+#include <stdlib.h>	// malloc()
+#include <string.h>	// strerror()
+#include <errno.h>	// errno
+#include <stdatomic.h>	// atomic_size_t
+
+#define ERROR(...) do {					\
+	snprintf(error, BUFSIZ, __VA_ARGS__);		\
+} while(false)
+
+// Byte ring over [base, base + size) of a Memory context. Only offsets
+// live here; the data itself stays in device memory. All cursors count
+// bytes monotonically and are reduced modulo size on use.
+//
+//   tail <= head <= reserve <= tail + size
+//
+// reserve is private to the receiver, head is advanced once a reserved
+// span has landed in device memory and tail is advanced by the consumer.
+struct ring {
+	size_t base;
+	size_t size;
+
+	size_t reserve;
+	atomic_size_t head;
+	atomic_size_t tail;
+};
+
+static __thread char error[BUFSIZ];
+
+Ring ring_create(size_t base, size_t size)
+{
+	Ring ring;
+
+	ring = malloc(sizeof(struct ring));
+	if (ring == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		return NULL;
+	}
+
+	ring->base = base;
+	ring->size = size;
+
+	ring->reserve = 0;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+
+	return ring;
+}
+
+size_t ring_space(Ring ring, size_t *offset)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	size_t position = ring->reserve % ring->size;
+	size_t space;
+
+	space = ring->size - (ring->reserve - tail);
+	if (space > ring->size - position)
+		space = ring->size - position;
+
+	*offset = ring->base + position;
+
+	return space;
+}
+
+void ring_reserve(Ring ring, size_t len)
+{
+	ring->reserve += len;
+}
+
+void ring_commit(Ring ring, size_t len)
+{
+	atomic_fetch_add_explicit(&ring->head, len, memory_order_release);
+}
+
+size_t ring_peek(Ring ring, size_t *offset)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t position = tail % ring->size;
+	size_t len;
+
+	len = head - tail;
+	if (len > ring->size - position)
+		len = ring->size - position;
+
+	*offset = ring->base + position;
+
+	return len;
+}
+
+void ring_consume(Ring ring, size_t len)
+{
+	atomic_fetch_add_explicit(&ring->tail, len, memory_order_release);
+}
+
+void ring_reset(Ring ring)
+{
+	ring->reserve = 0;
+	atomic_store(&ring->head, 0);
+	atomic_store(&ring->tail, 0);
+}
+
+void ring_assign(Ring ring, size_t base, size_t size)
+{
+	ring->base = base;
+	ring->size = size;
+
+	ring_reset(ring);
+}
+
+void ring_destroy(Ring ring)
+{
+	free(ring);
+}
+
+char *ring_get_error(void)
+{
+	return error;
+}
@@ -1,33 +1,139 @@
 #include "server.h"
 
+// must come before libc defines its own struct iovec
+#include <linux/uio.h>	// struct dmabuf_cmsg, struct dmabuf_token
+#define __iovec_defined
+
 #include <stdio.h>	// BUFSIZ
 #include <stdbool.h>	// true, false
 #include <stdlib.h>	// malloc()
 #include <string.h>	// strerror()
 #include <errno.h>	// errno
+#include <stdatomic.h>	// atomic_bool
 
 #include <unistd.h>	// close()
+#include <poll.h>	// poll()
+#include <pthread.h>	// pthread_create(), pthread_join()
 
 #include <sys/socket.h>	// accept(), recv(), send(), etc.
+#include <sys/epoll.h>	// epoll_create1(), epoll_ctl(), epoll_wait()
+#include <sys/mman.h>	// mmap(), munmap()
+#include <sys/ioctl.h>	// ioctl()
+#include <sys/time.h>	// struct timeval
+#include <netinet/in.h>	// IPPROTO_TCP
+#include <netinet/tcp.h>	// TCP_NODELAY
+
+
+#include <liburing.h>	// io_uring_*()
 
 #include "memory_provider.h"
+#include "copy_engine.h"
+#include "arena.h"
+#include "pipeline.h"
+#include "staging.h"
+#include "ring.h"
+#include "devmem.h"
+#include "stats.h"
+#include "stripe.h"
+#include "socket.h"
 
 #define BACKLOG		15
+#define MAX_CLIENTS	16
+#define MAX_EVENTS	64
+#define EPOLL_TIMEOUT	100	// ms, bounds the latency of server_stop()
+#define STALL_TIMEOUT	1	// ms, how often full rings are rechecked
+
+#define PIPELINE_DEPTH		8
+
+#define URING_ENTRIES		256
+#define URING_BUFFERS		256	// must be a power of two
+#define URING_BUFFER_SIZE	(64 * 1024)
+#define URING_BGID		0
+#define URING_CANCEL		((void *) 1)	// user_data of accept cancels
+
+#ifndef MSG_SOCK_DEVMEM
+#define MSG_SOCK_DEVMEM		0x2000000
+#endif
+
+#define DEVMEM_CONTROL_SIZE	(sizeof(int) * 20000)
+#define DEVMEM_MAX_FRAGS	\
+	(DEVMEM_CONTROL_SIZE / CMSG_SPACE(sizeof(struct dmabuf_cmsg)))
+
+// per SO_DEVMEM_DONTNEED call, as enforced by net/core/sock.c
+#define DONTNEED_MAX_TOKENS	128
+#define DONTNEED_MAX_FRAGS	1024
+
+// epoll busy polling arrived in Linux 6.9 and glibc 2.40
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+	uint32_t busy_poll_usecs;
+	uint16_t busy_poll_budget;
+	uint8_t prefer_busy_poll;
+	uint8_t __pad;
+};
+
+#define EPIOCSPARAMS	_IOW(0x8A, 0x01, struct epoll_params)
+#endif
 
 #define ERROR(...) do {					\
 	snprintf(error, BUFSIZ, __VA_ARGS__);		\
 } while(false)
 
+struct connection {
+	int fd;
+	size_t offset;
+	size_t recvlen;
+
+	Ring ring;
+	bool stalled;
+	bool overflow;
+
+	struct stats stats;
+};
+
 struct server {
 	int sockfd;
+	struct memory_provider *provider;
 	Memory context;
+	size_t offset;
 	size_t size;
+
+	StagingPool staging;
+	Devmem devmem;
+	size_t dmabuf_offset;
+	ServerFragConsumer frag_consumer;
+	void *frag_consumer_arg;
+	struct socket_profile *profile;
+
+	int busy_poll;
+	int busy_poll_budget;
+
+	bool ring_mode;
+	ServerConsumer consumer;
+	void *consumer_arg;
+	int nstalled;
+
+	ServerReport report;
+	void *report_arg;
+	uint64_t report_interval;
+	uint64_t next_report;
+	struct stats interval;
+	struct stats total;
+
+	Arena arena;
+	bool shared_arena;
+	size_t slice;
+	int nclient;
+	bool listening;
+	uint64_t retry_accept;
+	atomic_bool running;
+	struct connection clients[MAX_CLIENTS];
 };
 
-static char error[BUFSIZ];
-static struct memory_provider *provider = &amdgpu_memory_provider;
+static __thread char error[BUFSIZ];
 
-Server server_setup(int sockfd, Memory context)
+Server server_setup(int sockfd, struct memory_provider *provider,
+		    Memory context, size_t offset, size_t size)
 {
 	Server server;
 
@@ -38,129 +144,1746 @@ Server server_setup(int sockfd, Memory context)
 	}
 
 	server->sockfd = sockfd;
+	server->provider = provider;
 	server->context = context;
-	server->size = provider->get_size(context);
+	server->offset = offset;
+	server->size = size;
+
+	server->staging = NULL;
+	server->devmem = NULL;
+	server->dmabuf_offset = 0;
+	server->frag_consumer = NULL;
+	server->frag_consumer_arg = NULL;
+	server->profile = NULL;
+
+	server->busy_poll = 0;
+	server->busy_poll_budget = 0;
+
+	server->ring_mode = false;
+	server->consumer = NULL;
+	server->consumer_arg = NULL;
+	server->nstalled = 0;
+
+	server->report = NULL;
+	server->report_arg = NULL;
+	server->report_interval = 0;
+
+	// connections take slices out of the arena while they last
+	server->arena = arena_create(offset, size, SERVER_SLICE_ALIGN);
+	if (server->arena == NULL) {
+		ERROR("failed to arena_create(): %s", arena_get_error());
+		goto FREE_SERVER;
+	}
+
+	// a client sends its whole buffer, so by default it gets all of ours
+	server->shared_arena = false;
+	server->slice = size / SERVER_SLICE_ALIGN * SERVER_SLICE_ALIGN;
+
+	server->nclient = 0;
+	server->listening = false;
+	server->retry_accept = 0;
+	atomic_init(&server->running, true);
+
+	for (int i = 0; i < MAX_CLIENTS; i++)
+		server->clients[i].ring = NULL;
+
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		struct connection *conn = &server->clients[i];
+
+		conn->fd = -1;
+		conn->offset = offset;
+		conn->recvlen = 0;
+		conn->stalled = false;
+		conn->overflow = false;
+
+		conn->ring = ring_create(conn->offset, server->slice);
+		if (conn->ring == NULL) {
+			ERROR("failed to ring_create(): %s", ring_get_error());
+			goto DESTROY_RINGS;
+		}
+	}
 
 	if (listen(sockfd, BACKLOG) == -1) {
-		free(server);
 		ERROR("failed to listen(): %s", strerror(errno));
-		return NULL;
+		goto DESTROY_RINGS;
 	}
 
 	return server;
+
+DESTROY_RINGS:	for (int i = 0; i < MAX_CLIENTS; i++)
+			if (server->clients[i].ring != NULL)
+				ring_destroy(server->clients[i].ring);
+		arena_destroy(server->arena);
+FREE_SERVER:	free(server);
+		return NULL;
+}
+
+void server_set_arena(Server server, Arena arena)
+{
+	if ( !server->shared_arena )
+		arena_destroy(server->arena);
+
+	server->arena = arena;
+	server->shared_arena = true;
+}
+
+int server_set_slice(Server server, size_t slice)
+{
+	// the arena could never hand out such a slice, and clients would
+	// wait in the backlog for good
+	if (slice == 0 || slice % SERVER_SLICE_ALIGN != 0) {
+		ERROR("slice of %zu bytes is not a multiple of %d", slice,
+		      SERVER_SLICE_ALIGN);
+		return -1;
+	}
+
+	if (slice > server->size) {
+		ERROR("slice of %zu bytes exceeds the %zu of the server", slice,
+		      server->size);
+		return -1;
+	}
+
+	server->slice = slice;
+
+	return 0;
+}
+
+void server_set_staging(Server server, StagingPool staging)
+{
+	server->staging = staging;
+}
+
+void server_set_profile(Server server, struct socket_profile *profile)
+{
+	server->profile = profile;
+}
+
+// Per connection part of the profile; whatever is set on the listening
+// socket is inherited by accepted ones already. Best effort: a client
+// we fail to tune is still served.
+static void server_tune_client(Server server, int clnt_fd)
+{
+	if (server->profile != NULL)
+		socket_autotune(clnt_fd, server->profile);
+}
+
+void server_set_busy_poll(Server server, int usecs, int budget)
+{
+	server->busy_poll = usecs;
+	server->busy_poll_budget = budget;
+}
+
+// Let epoll_wait() poll the NIC queue for a while before it sleeps.
+// Returns the epoll_wait() timeout to use: on kernels without epoll
+// busy polling we fall back to spinning on epoll_wait() ourselves.
+static int server_busy_poll_epoll(Server server, int epfd)
+{
+	struct epoll_params params;
+
+	if (server->busy_poll == 0)
+		return EPOLL_TIMEOUT;
+
+	memset(&params, 0x00, sizeof(params));
+	params.busy_poll_usecs = server->busy_poll;
+	params.busy_poll_budget = server->busy_poll_budget;
+	params.prefer_busy_poll = 1;
+
+	if (ioctl(epfd, EPIOCSPARAMS, &params) == -1)
+		return 0;
+
+	return EPOLL_TIMEOUT;
+}
+
+void server_set_ring(Server server, ServerConsumer consumer, void *arg)
+{
+	server->ring_mode = true;
+	server->consumer = consumer;
+	server->consumer_arg = arg;
+}
+
+void server_set_frag_consumer(Server server, ServerFragConsumer consumer,
+			      void *arg)
+{
+	server->frag_consumer = consumer;
+	server->frag_consumer_arg = arg;
+}
+
+static StagingPool server_get_staging(Server server)
+{
+	StagingPool staging;
+
+	if (server->staging != NULL)
+		return server->staging;
+
+	staging = staging_create(STAGING_DEFAULT_NCHUNK,
+			  	 STAGING_DEFAULT_CHUNK_SIZE);
+	if (staging == NULL)
+		ERROR("failed to staging_create(): %s", staging_get_error());
+
+	return staging;
+}
+
+static void server_put_staging(Server server, StagingPool staging)
+{
+	if (staging != server->staging)
+		staging_destroy(staging);
+}
+
+void server_set_report(Server server, ServerReport report, void *arg,
+		       int interval)
+{
+	server->report = report;
+	server->report_arg = arg;
+	server->report_interval = interval * 1000000ULL;
+}
+
+static void server_report(Server server, const char *label,
+			  struct stats *stats)
+{
+	stats->end_ns = stats_now();
+
+	if (server->report != NULL)
+		server->report(label, stats, server->report_arg);
+}
+
+static void server_report_client(Server server, struct connection *conn)
+{
+	char label[32];
+
+	snprintf(label, sizeof(label), "client %ld%s", conn - server->clients,
+		 conn->overflow ? " (slice overflow)" : "");
+	server_report(server, label, &conn->stats);
+}
+
+static void server_begin_stats(Server server)
+{
+	stats_reset(&server->interval);
+	stats_reset(&server->total);
+
+	server->next_report = server->interval.start_ns
+			    + server->report_interval;
+}
+
+static void server_account_recv(Server server, struct connection *conn,
+				ssize_t len)
+{
+	stats_record_recv(&conn->stats, len);
+	stats_record_recv(&server->interval, len);
+	stats_record_recv(&server->total, len);
+}
+
+static void server_account_copy(Server server, struct connection *conn,
+				uint64_t nanoseconds)
+{
+	stats_record_copy(&conn->stats, nanoseconds);
+	stats_record_copy(&server->interval, nanoseconds);
+	stats_record_copy(&server->total, nanoseconds);
+}
+
+// The pipeline times copies on its own thread, so they are collected
+// into the server-wide numbers only; per client stats carry none.
+static void server_collect_copies(Server server, Pipeline pipeline)
+{
+	struct histogram copy_ns;
+
+	if (pipeline == NULL)
+		return;
+
+	histogram_reset(&copy_ns);
+	pipeline_take_copy_ns(pipeline, &copy_ns);
+
+	histogram_merge(&server->interval.copy_ns, &copy_ns);
+	histogram_merge(&server->total.copy_ns, &copy_ns);
+}
+
+static void server_tick(Server server, Pipeline pipeline)
+{
+	uint64_t now;
+
+	if (server->report_interval == 0)
+		return;
+
+	now = stats_now();
+	if (now < server->next_report)
+		return;
+
+	server_collect_copies(server, pipeline);
+	server_report(server, "interval", &server->interval);
+
+	stats_reset(&server->interval);
+	server->next_report = now + server->report_interval;
+}
+
+static void server_end_stats(Server server, Pipeline pipeline)
+{
+	server_collect_copies(server, pipeline);
+	server_report(server, "total", &server->total);
+}
+
+int server_bind_devmem(Server server, const char *ifname, int dmabuf_fd,
+		       size_t dmabuf_offset, int start_queue, int num_queues)
+{
+	server->devmem = devmem_bind_rx(ifname, dmabuf_fd,
+				 	start_queue, num_queues);
+	if (server->devmem == NULL) {
+		ERROR("failed to devmem_bind_rx(): %s", devmem_get_error());
+		return -1;
+	}
+
+	server->dmabuf_offset = dmabuf_offset;
+
+	return 0;
+}
+
+// An accept() that gives up once the server is stopped.
+static int server_wait_client(Server server)
+{
+	struct pollfd pfd;
+	int clnt_fd;
+
+	while (atomic_load(&server->running)) {
+		pfd.fd = server->sockfd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, EPOLL_TIMEOUT) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			ERROR("failed to poll(): %s", strerror(errno));
+			return -1;
+		}
+
+		if ( !(pfd.revents & POLLIN) )
+			continue;
+
+		clnt_fd = accept(server->sockfd, NULL, 0);
+		if (clnt_fd == -1) {
+			ERROR("failed to accept(): %s", strerror(errno));
+			return -1;
+		}
+
+		return clnt_fd;
+	}
+
+	ERROR("stopped while waiting for a client");
+	return -1;
+}
+
+// Runs of consecutive tokens share an entry, so one SO_DEVMEM_DONTNEED
+// returns many frags.
+static void server_add_token(struct dmabuf_token *tokens, int *ntoken,
+			     uint32_t token)
+{
+	struct dmabuf_token *last = tokens + *ntoken - 1;
+
+	if (*ntoken > 0 && last->token_start + last->token_count == token
+	 && last->token_count < DONTNEED_MAX_FRAGS) {
+		last->token_count++;
+		return;
+	}
+
+	tokens[*ntoken].token_start = token;
+	tokens[*ntoken].token_count = 1;
+	(*ntoken)++;
+}
+
+static int server_release_frags(int clnt_fd, struct dmabuf_token *tokens,
+				int ntoken)
+{
+	int first = 0;
+
+	while (first < ntoken) {
+		size_t nfrag = 0;
+		int ret;
+		int n;
+
+		for (n = 0; first + n < ntoken && n < DONTNEED_MAX_TOKENS; n++) {
+			if (nfrag + tokens[first + n].token_count
+			    > DONTNEED_MAX_FRAGS)
+				break;
+
+			nfrag += tokens[first + n].token_count;
+		}
+
+		ret = setsockopt(clnt_fd, SOL_SOCKET, SO_DEVMEM_DONTNEED,
+				 &tokens[first], sizeof(struct dmabuf_token) * n);
+		if (ret != nfrag) {
+			ERROR("failed to setsockopt(SO_DEVMEM_DONTNEED): %s",
+			      ret == -1 ? strerror(errno)
+			      		: "frags were not released");
+			return -1;
+		}
+
+		first += n;
+	}
+
+	return 0;
 }
 
+// With a dmabuf binding, devmem frags stay where the NIC placed them:
+// each recvmsg()'s frags are handed to the frag consumer, and their
+// buffers are returned to the NIC only once it is done with them.
+//
+// Without a dmabuf binding this is the plain copy path: the flag is
+// dropped and every byte arrives in a staging chunk. Chunks rotate
+// through a copy engine, so the next recvmsg() overlaps the copies of
+// the previous ones; the copy time accounted is what the receive loop
+// still had to wait for.
 int server_run_as_dma(Server server)
 {
+	struct connection *conn;
+	StagingPool staging;
+	CopyEngine engine;
+	uint64_t elapsed;
 	int clnt_fd;
 	size_t recvlen;
-	char *ubuffer;
+	size_t chunk_size;
+	struct {
+		char *buffer;
+		CopyFence fence;
+	} chunks[SERVER_COPY_DEPTH];
+	int nchunk;
+	int next;
+	struct server_frag *frags;
+	struct dmabuf_token *tokens;
+	struct timeval timeout;
+	char *control;
 	size_t size;
 	Memory context;
+	int flags;
 
 	size = server->size;
 	context = server->context;
 
-	ubuffer = malloc(size);
-	if (ubuffer == NULL) {
-		ERROR("failed to malloc(): %s", strerror(errno));
+	staging = server_get_staging(server);
+	if (staging == NULL)
 		goto RETURN_ERROR;
+
+	chunk_size = staging_get_chunk_size(staging);
+
+	nchunk = staging_get_nchunk(staging);
+	if (nchunk > SERVER_COPY_DEPTH)
+		nchunk = SERVER_COPY_DEPTH;
+
+	for (int i = 0; i < nchunk; i++) {
+		chunks[i].buffer = staging_get(staging);
+		chunks[i].fence = 0;
 	}
 
-	clnt_fd = accept(server->sockfd, NULL, 0);
-	if (clnt_fd == -1) {
-		ERROR("failed to accept(): %s", strerror(errno));
-		goto FREE_BUFFER;
+	engine = copy_engine_create(server->provider, context, nchunk);
+	if (engine == NULL) {
+		ERROR("failed to copy_engine_create(): %s",
+		      copy_engine_get_error());
+		goto PUT_CHUNKS;
+	}
+
+	control = NULL;
+	frags = NULL;
+	tokens = NULL;
+	flags = 0;
+	if (server->devmem != NULL) {
+		control = malloc(DEVMEM_CONTROL_SIZE);
+		frags = malloc(sizeof(struct server_frag) * DEVMEM_MAX_FRAGS);
+		tokens = malloc(sizeof(struct dmabuf_token) * DEVMEM_MAX_FRAGS);
+		if (control == NULL || frags == NULL || tokens == NULL) {
+			ERROR("failed to malloc(): %s", strerror(errno));
+			goto FREE_CONTROL;
+		}
+
+		flags = MSG_SOCK_DEVMEM;
+	}
+
+	clnt_fd = server_wait_client(server);
+	if (clnt_fd == -1)
+		goto FREE_CONTROL;
+
+	server_tune_client(server, clnt_fd);
+
+	// recvmsg() gives up now and then to notice server_stop()
+	timeout.tv_sec = 0;
+	timeout.tv_usec = EPOLL_TIMEOUT * 1000;
+	if (setsockopt(clnt_fd, SOL_SOCKET, SO_RCVTIMEO,
+		&timeout, sizeof(timeout)) == -1) {
+		ERROR("failed to setsockopt(SO_RCVTIMEO): %s", strerror(errno));
+		goto CLOSE_CLNT_FD;
 	}
 
+	conn = &server->clients[0];
+	conn->overflow = false;
+	server_begin_stats(server);
+	stats_reset(&conn->stats);
+
 	recvlen = 0;
+	next = 0;
 	while (true) {
-		int ret = recv(clnt_fd, ubuffer, size - recvlen, 0);
+		struct msghdr msg = { 0 };
+		struct cmsghdr *cm;
+		struct iovec iov;
+		ssize_t linear;
+		ssize_t ret;
+		int ntoken;
+		int nfrag;
+
+		// the chunk is free again once its last copy landed
+		if (chunks[next].fence != 0) {
+			elapsed = stats_now();
+			if (copy_engine_wait(engine, chunks[next].fence) == -1) {
+				ERROR("failed to copy_engine_wait(): %s",
+	  			      copy_engine_get_error());
+				goto CLOSE_CLNT_FD;
+			}
+			server_account_copy(server, conn, stats_now() - elapsed);
+
+			chunks[next].fence = 0;
+		}
+
+		// a full buffer ends the transfer: recvmsg() of 0 bytes would
+		// look like EOF, so peek to tell an overflow from the end
+		if (control == NULL && recvlen == size) {
+			char byte;
+
+			ret = recv(clnt_fd, &byte, 1, MSG_PEEK);
+			if (ret == -1 && (errno == EINTR || errno == EAGAIN)) {
+				if ( !atomic_load(&server->running) )
+					break;
+
+				continue;
+			}
+
+			if (ret > 0)
+				conn->overflow = true;
+			break;
+		}
+
+		// device memory frags do not count against the slice
+		iov.iov_base = chunks[next].buffer;
+		iov.iov_len = chunk_size;
+		if (control == NULL && iov.iov_len > size - recvlen)
+			iov.iov_len = size - recvlen;
+
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = control ? DEVMEM_CONTROL_SIZE : 0;
+
+		ret = recvmsg(clnt_fd, &msg, flags);
+		server_account_recv(server, conn, ret);
+		server_tick(server, NULL);
+
 		if (ret == -1) {
-			ERROR("failed to recv(): %s", strerror(errno));
-			goto CLOSE_CLNT_FD;
+			if (errno != EINTR && errno != EAGAIN) {
+				ERROR("failed to recvmsg(): %s",
+				      strerror(errno));
+				goto CLOSE_CLNT_FD;
+			}
+
+			if ( !atomic_load(&server->running) )
+				break;
+
+			continue;
 		}
 
 		if (ret == 0)
 			break;
 
-		ret = provider->memcpy_to(context, ubuffer, recvlen, ret);
-		if (ret == -1) {
-			ERROR("failed to amdgpu_memory_provider->memcpy_to(): "
-	 		      "%s", provider->get_error());
+		linear = ret;
+		ntoken = 0;
+		nfrag = 0;
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			struct dmabuf_cmsg *frag;
+
+			// SCM_DEVMEM_LINEAR bytes are already in the iov
+			if (cm->cmsg_level != SOL_SOCKET
+			 || cm->cmsg_type != SCM_DEVMEM_DMABUF)
+				continue;
+
+			frag = (struct dmabuf_cmsg *) CMSG_DATA(cm);
+			if (frag->dmabuf_id != devmem_get_id(server->devmem)) {
+				ERROR("received on wrong dmabuf_id %u: "
+	  			      "flow steering error", frag->dmabuf_id);
+				goto CLOSE_CLNT_FD;
+			}
+
+			// the payload already sits in device memory
+			linear -= frag->frag_size;
+
+			frags[nfrag].offset = frag->frag_offset
+					    - server->dmabuf_offset;
+			frags[nfrag].len = frag->frag_size;
+			nfrag++;
+
+			server_add_token(tokens, &ntoken, frag->frag_token);
+		}
+
+		if (nfrag > 0 && server->frag_consumer != NULL)
+			server->frag_consumer(frags, nfrag, context,
+					      server->frag_consumer_arg);
+
+		if (server_release_frags(clnt_fd, tokens, ntoken) == -1)
+			goto CLOSE_CLNT_FD;
+
+		if (linear == 0)
+			continue;
+
+		if (linear > size - recvlen) {
+			ERROR("linear data overflows the buffer");
 			goto CLOSE_CLNT_FD;
 		}
 
-		recvlen += ret;
+		chunks[next].fence = copy_engine_to(engine, chunks[next].buffer,
+						    server->offset + recvlen,
+						    linear);
+		next = (next + 1) % nchunk;
+
+		recvlen += linear;
+	}
+
+	elapsed = stats_now();
+	if (copy_engine_drain(engine) == -1) {
+		ERROR("failed to copy_engine_drain(): %s",
+		      copy_engine_get_error());
+		goto CLOSE_CLNT_FD;
 	}
+	server_account_copy(server, conn, stats_now() - elapsed);
+
+	server_report_client(server, conn);
+	server_end_stats(server, NULL);
 
 	close(clnt_fd);
-	free(ubuffer);
+	free(tokens);
+	free(frags);
+	free(control);
+	copy_engine_destroy(engine);
+	for (int i = 0; i < nchunk; i++)
+		staging_put(staging, chunks[i].buffer);
+	server_put_staging(server, staging);
 
 	return 0;
 
 CLOSE_CLNT_FD:	close(clnt_fd);
-FREE_BUFFER:	free(ubuffer);
+FREE_CONTROL:	free(tokens);
+		free(frags);
+		free(control);
+		copy_engine_destroy(engine);
+PUT_CHUNKS:	for (int i = 0; i < nchunk; i++)
+			staging_put(staging, chunks[i].buffer);
+		server_put_staging(server, staging);
 RETURN_ERROR:	return -1;
 }
 
+struct stripe_worker {
+	Server server;
+	StagingPool staging;
+	int fd;
+	struct stripe_header header;
+	struct stats stats;
 
-int server_run_as_tcp(Server server)
+	pthread_t tid;
+	int ret;
+	char message[BUFSIZ];
+};
+
+static void *server_receive_stripe(void *arg)
 {
-	int clnt_fd;
+	struct stripe_worker *worker = arg;
+	struct stripe_header *header = &worker->header;
+	Server server = worker->server;
+	Pipeline pipeline;
 	size_t recvlen;
-	char *ubuffer;
-	size_t size;
-	Memory context;
+	size_t bufsize;
 
-	size = server->size;
-	context = server->context;
+	stats_reset(&worker->stats);
 
-	ubuffer = malloc(size);
-	if (ubuffer == NULL) {
-		ERROR("failed to malloc(): %s", strerror(errno));
+	pipeline = pipeline_create(server->provider, server->context,
+				   worker->staging, PIPELINE_DEPTH);
+	if (pipeline == NULL) {
+		ERROR("failed to pipeline_create(): %s", pipeline_get_error());
 		goto RETURN_ERROR;
 	}
 
-	clnt_fd = accept(server->sockfd, NULL, 0);
-	if (clnt_fd == -1) {
-		ERROR("failed to accept(): %s", strerror(errno));
-		goto FREE_BUFFER;
-	}
+	bufsize = pipeline_get_bufsize(pipeline);
 
 	recvlen = 0;
-	while (true) {
-		int ret = recv(clnt_fd, ubuffer, size - recvlen, 0);
+	while (recvlen < header->len) {
+		size_t len = header->len - recvlen;
+		void *buffer;
+		ssize_t ret;
+
+		if (len > bufsize)
+			len = bufsize;
+
+		buffer = pipeline_acquire(pipeline);
+
+		ret = recv(worker->fd, buffer, len, 0);
+		stats_record_recv(&worker->stats, ret);
+
 		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+
 			ERROR("failed to recv(): %s", strerror(errno));
-			goto CLOSE_CLNT_FD;
+			goto DESTROY_PIPELINE;
 		}
 
-		if (ret == 0)
-			break;
+		if (ret == 0) {
+			ERROR("closed after %zu of %lu bytes",
+	 		      recvlen, header->len);
+			goto DESTROY_PIPELINE;
+		}
 
-		ret = provider->memcpy_to(context, ubuffer, recvlen, ret);
-		if (ret == -1) {
-			ERROR("failed to amdgpu_memory_provider->memcpy_to(): "
-	 		      "%s", provider->get_error());
-			goto CLOSE_CLNT_FD;
+		if (pipeline_submit(pipeline,
+		      		    server->offset + header->offset + recvlen,
+		      		    ret, NULL) == -1) {
+			ERROR("failed to pipeline_submit(): %s",
+	 		      pipeline_get_error());
+			goto DESTROY_PIPELINE;
 		}
 
 		recvlen += ret;
 	}
 
-	close(clnt_fd);
-	free(ubuffer);
+	if (pipeline_flush(pipeline) == -1) {
+		ERROR("failed to pipeline_flush(): %s", pipeline_get_error());
+		goto DESTROY_PIPELINE;
+	}
 
-	return 0;
+	pipeline_take_copy_ns(pipeline, &worker->stats.copy_ns);
+	pipeline_destroy(pipeline);
 
-CLOSE_CLNT_FD:	close(clnt_fd);
-FREE_BUFFER:	free(ubuffer);
-RETURN_ERROR:	return -1;
+	worker->ret = 0;
+	return NULL;
+
+DESTROY_PIPELINE:
+		pipeline_destroy(pipeline);
+RETURN_ERROR:	snprintf(worker->message, BUFSIZ, "%s", error);
+		worker->ret = -1;
+		return NULL;
 }
 
-void server_cleanup(Server server)
+// Reads and checks the header of a stripe connection. The first one
+// fixes the number of stripes the transfer is made of.
+static int server_accept_stripe(Server server, int clnt_fd,
+				struct stripe_header *header,
+				int *count, bool *seen)
 {
+	ssize_t ret;
+
+	ret = recv(clnt_fd, header, sizeof(struct stripe_header), MSG_WAITALL);
+	if (ret != sizeof(struct stripe_header)) {
+		ERROR("failed to recv() the stripe header: %s",
+		      ret == -1 ? strerror(errno) : "short read");
+		return -1;
+	}
+
+	stripe_header_decode(header);
+
+	if (*count == 0) {
+		if (header->count == 0 || header->count > MAX_CLIENTS) {
+			ERROR("unsupported number of stripes: %u",
+	 		      header->count);
+			return -1;
+		}
+
+		*count = header->count;
+	}
+
+	if (header->count != *count || header->index >= *count
+	    || seen[header->index]) {
+		ERROR("unexpected stripe %u of %u", header->index,
+		      header->count);
+		return -1;
+	}
+
+	if (header->len > server->size
+	    || header->offset > server->size - header->len) {
+		ERROR("stripe %u overflows the buffer", header->index);
+		return -1;
+	}
+
+	seen[header->index] = true;
+
+	return 0;
+}
+
+// Receives a transfer striped over several connections, each into its
+// own range of the context on its own thread. Returns once every stripe
+// announced by the first header has been received; there are no
+// interval reports, only one per stripe and the total.
+int server_run_as_striped(Server server)
+{
+	struct stripe_worker workers[MAX_CLIENTS];
+	bool seen[MAX_CLIENTS] = { false };
+	StagingPool staging;
+	int nstarted;
+	int count;
+	int ret;
+
+	staging = server_get_staging(server);
+	if (staging == NULL)
+		return -1;
+
+	server_begin_stats(server);
+
+	ret = 0;
+	count = 0;
+	nstarted = 0;
+	while (count == 0 || nstarted < count) {
+		struct stripe_worker *worker = &workers[nstarted];
+		int clnt_fd;
+
+		clnt_fd = server_wait_client(server);
+		if (clnt_fd == -1) {
+			ret = -1;
+			break;
+		}
+
+		server_tune_client(server, clnt_fd);
+
+		if (server_accept_stripe(server, clnt_fd, &worker->header,
+			   		 &count, seen) == -1) {
+			close(clnt_fd);
+			ret = -1;
+			break;
+		}
+
+		worker->server = server;
+		worker->staging = staging;
+		worker->fd = clnt_fd;
+
+		if (pthread_create(&worker->tid, NULL,
+		     		   server_receive_stripe, worker)) {
+			ERROR("failed to pthread_create()");
+			close(clnt_fd);
+			ret = -1;
+			break;
+		}
+
+		nstarted++;
+	}
+
+	for (int i = 0; i < nstarted; i++) {
+		struct stripe_worker *worker = &workers[i];
+		char label[32];
+
+		pthread_join(worker->tid, NULL);
+		close(worker->fd);
+
+		if (worker->ret == -1 && ret == 0) {
+			ERROR("stripe %u: %s", worker->header.index,
+	 		      worker->message);
+			ret = -1;
+		}
+
+		snprintf(label, sizeof(label), "stripe %u",
+	   		 worker->header.index);
+		server_report(server, label, &worker->stats);
+		stats_merge(&server->total, &worker->stats);
+	}
+
+	server_end_stats(server, NULL);
+	server_put_staging(server, staging);
+
+	return ret;
+}
+
+static int server_echo(int clnt_fd, char *buffer, size_t len)
+{
+	while (len > 0) {
+		ssize_t ret = send(clnt_fd, buffer, len, 0);
+
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+
+			ERROR("failed to send(): %s", strerror(errno));
+			return -1;
+		}
+
+		buffer += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+// Echoes whatever one client sends, after a round trip through device
+// memory, so the client's RTT covers both copies.
+int server_run_as_pingpong(Server server)
+{
+	struct connection *conn;
+	StagingPool staging;
+	size_t chunk_size;
+	char *ubuffer;
+	int clnt_fd;
+	int one = 1;
+
+	staging = server_get_staging(server);
+	if (staging == NULL)
+		goto RETURN_ERROR;
+
+	ubuffer = staging_get(staging);
+	chunk_size = staging_get_chunk_size(staging);
+	if (chunk_size > server->size)
+		chunk_size = server->size;
+
+	clnt_fd = server_wait_client(server);
+	if (clnt_fd == -1)
+		goto FREE_BUFFER;
+
+	server_tune_client(server, clnt_fd);
+
+	// Nagle would hold back every echo for the delayed ACK
+	if (setsockopt(clnt_fd, IPPROTO_TCP, TCP_NODELAY,
+		&one, sizeof(one)) == -1) {
+		ERROR("failed to setsockopt(TCP_NODELAY): %s", strerror(errno));
+		goto CLOSE_CLNT_FD;
+	}
+
+	conn = &server->clients[0];
+	server_begin_stats(server);
+	stats_reset(&conn->stats);
+
+	while (true) {
+		uint64_t elapsed;
+		ssize_t ret;
+
+		ret = recv(clnt_fd, ubuffer, chunk_size, 0);
+		server_account_recv(server, conn, ret);
+
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+
+			ERROR("failed to recv(): %s", strerror(errno));
+			goto CLOSE_CLNT_FD;
+		}
+
+		if (ret == 0)
+			break;
+
+		elapsed = stats_now();
+		if (server->provider->memcpy_to(server->context, ubuffer,
+						server->offset, ret) == -1
+		    || server->provider->memcpy_from(ubuffer, server->context,
+						     server->offset, ret) == -1) {
+			ERROR("failed to copy through the provider: %s",
+	 		      server->provider->get_error());
+			goto CLOSE_CLNT_FD;
+		}
+		server_account_copy(server, conn, stats_now() - elapsed);
+
+		if (server_echo(clnt_fd, ubuffer, ret) == -1)
+			goto CLOSE_CLNT_FD;
+
+		server_tick(server, NULL);
+	}
+
+	server_report_client(server, conn);
+	server_end_stats(server, NULL);
+
+	close(clnt_fd);
+	staging_put(staging, ubuffer);
+	server_put_staging(server, staging);
+
+	return 0;
+
+CLOSE_CLNT_FD:	close(clnt_fd);
+FREE_BUFFER:	staging_put(staging, ubuffer);
+		server_put_staging(server, staging);
+RETURN_ERROR:	return -1;
+}
+
+static int server_watch_listener(Server server, int epfd, int op)
+{
+	struct epoll_event event;
+
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+
+	if (epoll_ctl(epfd, op, server->sockfd, &event) == -1) {
+		ERROR("failed to epoll_ctl(): %s", strerror(errno));
+		return -1;
+	}
+
+	server->listening = op == EPOLL_CTL_ADD;
+
+	return 0;
+}
+
+// Pending clients wait in the backlog while every slot is taken or the
+// arena has no slice for them. A shared arena may get one back from
+// another server, so a starved server retries every EPOLL_TIMEOUT.
+static int server_pause_accepting(Server server, int epfd, bool starved)
+{
+	server->retry_accept = starved
+			     ? stats_now() + EPOLL_TIMEOUT * 1000000ULL : 0;
+
+	return server_watch_listener(server, epfd, EPOLL_CTL_DEL);
+}
+
+static int server_resume_accepting(Server server, int epfd)
+{
+	if (server->listening || server->nclient == MAX_CLIENTS
+	 || stats_now() < server->retry_accept)
+		return 0;
+
+	return server_watch_listener(server, epfd, EPOLL_CTL_ADD);
+}
+
+static struct connection *server_find_slot(Server server)
+{
+	for (int i = 0; i < MAX_CLIENTS; i++)
+		if (server->clients[i].fd == -1)
+			return &server->clients[i];
+
+	return NULL;
+}
+
+// Gives conn a slice of device memory of its own while it is connected;
+// a shared arena may run out before the slots do.
+static int server_assign_slice(Server server, struct connection *conn)
+{
+	if (arena_alloc(server->arena, server->slice, &conn->offset) == -1)
+		return -1;
+
+	ring_assign(conn->ring, conn->offset, server->slice);
+
+	return 0;
+}
+
+static void server_release_slice(Server server, struct connection *conn)
+{
+	arena_free(server->arena, conn->offset, server->slice);
+}
+
+static void server_close_client(Server server, int epfd,
+				struct connection *conn)
+{
+	server_report_client(server, conn);
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	server_release_slice(server, conn);
+
+	conn->fd = -1;
+	conn->recvlen = 0;
+
+	if (conn->stalled) {
+		conn->stalled = false;
+		server->nstalled--;
+	}
+
+	// a slot and a slice are free again: accept at once
+	server->nclient--;
+	server->retry_accept = 0;
+}
+
+static int server_accept_client(Server server, int epfd)
+{
+	struct epoll_event event;
+	struct connection *conn;
+	int clnt_fd;
+
+	// paused by an earlier event of the same epoll_wait()
+	if ( !server->listening )
+		return 0;
+
+	conn = server_find_slot(server);
+	if (server_assign_slice(server, conn) == -1)
+		return server_pause_accepting(server, epfd, true);
+
+	clnt_fd = accept(server->sockfd, NULL, 0);
+	if (clnt_fd == -1) {
+		server_release_slice(server, conn);
+
+		if (errno == EINTR || errno == ECONNABORTED)
+			return 0;
+
+		ERROR("failed to accept(): %s", strerror(errno));
+		return -1;
+	}
+
+	server_tune_client(server, clnt_fd);
+
+	conn->fd = clnt_fd;
+	conn->recvlen = 0;
+	conn->overflow = false;
+	stats_reset(&conn->stats);
+
+	event.events = EPOLLIN;
+	event.data.ptr = conn;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, clnt_fd, &event) == -1) {
+		ERROR("failed to epoll_ctl(): %s", strerror(errno));
+		server_release_slice(server, conn);
+		close(clnt_fd);
+		conn->fd = -1;
+		return -1;
+	}
+
+	if (++server->nclient == MAX_CLIENTS)
+		return server_pause_accepting(server, epfd, false);
+
+	return 0;
+}
+
+static void server_discard(Ring ring, Memory context, void *arg)
+{
+	size_t offset, len;
+
+	// twice at most: up to the end of the ring, then from its start
+	while ((len = ring_peek(ring, &offset)) > 0)
+		ring_consume(ring, len);
+}
+
+static void server_consume(Server server, struct connection *conn)
+{
+	if (server->consumer != NULL)
+		server->consumer(conn->ring, server->context,
+		   		 server->consumer_arg);
+	else
+		server_discard(conn->ring, server->context, NULL);
+}
+
+static int server_watch_client(Server server, int epfd,
+			       struct connection *conn, bool watch)
+{
+	struct epoll_event event;
+
+	event.events = watch ? EPOLLIN : 0;
+	event.data.ptr = conn;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &event) == -1) {
+		ERROR("failed to epoll_ctl(): %s", strerror(errno));
+		return -1;
+	}
+
+	conn->stalled = !watch;
+	server->nstalled += watch ? -1 : 1;
+
+	return 0;
+}
+
+// Hand newly landed ring data to the consumer and resume receiving on
+// the connections whose rings it has made room in.
+static int server_drain_rings(Server server, int epfd)
+{
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		struct connection *conn = &server->clients[i];
+		size_t offset;
+
+		if (conn->fd == -1)
+			continue;
+
+		server_consume(server, conn);
+
+		if (conn->stalled && ring_space(conn->ring, &offset) > 0)
+			if (server_watch_client(server, epfd, conn, true) == -1)
+				return -1;
+	}
+
+	return 0;
+}
+
+static int server_finish_client(Server server, int epfd,
+				struct connection *conn, Pipeline pipeline)
+{
+	// copies queued for the slice land before it goes back to the
+	// arena, which may hand it to another shard right away; and the
+	// consumer gets to see every byte
+	if (pipeline_flush(pipeline) == -1) {
+		ERROR("failed to pipeline_flush(): %s", pipeline_get_error());
+		return -1;
+	}
+
+	if (server->ring_mode)
+		server_consume(server, conn);
+
+	server_close_client(server, epfd, conn);
+
+	return 0;
+}
+
+// A full slice takes no more data: the client is done if it closed,
+// and is dropped as overflowing it otherwise. recv() with a length of
+// 0 would return 0 either way.
+static int server_check_overflow(Server server, int epfd,
+				 struct connection *conn, Pipeline pipeline)
+{
+	char byte;
+	int ret;
+
+	ret = recv(conn->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+	if (ret == -1 && (errno == EINTR || errno == EAGAIN))
+		return 0;
+
+	if (ret > 0)
+		conn->overflow = true;
+
+	return server_finish_client(server, epfd, conn, pipeline);
+}
+
+static int server_receive(Server server, int epfd,
+			  struct connection *conn, Pipeline pipeline)
+{
+	size_t offset;
+	size_t len;
+	void *buffer;
+	int ret;
+
+	if (server->ring_mode) {
+		len = ring_space(conn->ring, &offset);
+		if (len == 0)	// leave the data in the socket until drained
+			return server_watch_client(server, epfd, conn, false);
+	} else {
+		len = server->slice - conn->recvlen;
+		offset = conn->offset + conn->recvlen;
+
+		if (len == 0)
+			return server_check_overflow(server, epfd, conn,
+						     pipeline);
+	}
+
+	if (len > pipeline_get_bufsize(pipeline))
+		len = pipeline_get_bufsize(pipeline);
+
+	// the copy thread drains earlier chunks while we keep receiving
+	buffer = pipeline_acquire(pipeline);
+
+	ret = recv(conn->fd, buffer, len, 0);
+	server_account_recv(server, conn, ret);
+
+	// the pool is shared: keep no chunk while waiting for more data
+	if (ret <= 0)
+		pipeline_release(pipeline);
+
+	if (ret == -1) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+
+		// a broken client must not take the whole server down
+		return server_finish_client(server, epfd, conn, pipeline);
+	}
+
+	if (ret == 0)
+		return server_finish_client(server, epfd, conn, pipeline);
+
+	if (server->ring_mode)
+		ring_reserve(conn->ring, ret);
+
+	if (pipeline_submit(pipeline, offset, ret,
+		     	    server->ring_mode ? conn->ring : NULL) == -1) {
+		ERROR("failed to pipeline_submit(): %s", pipeline_get_error());
+		return -1;
+	}
+
+	conn->recvlen += ret;
+
+	return 0;
+}
+
+int server_run_as_tcp(Server server)
+{
+	struct epoll_event events[MAX_EVENTS];
+	StagingPool staging;
+	Pipeline pipeline;
+	int timeout;
+	int epfd;
+
+	staging = server_get_staging(server);
+	if (staging == NULL)
+		goto RETURN_ERROR;
+
+	pipeline = pipeline_create(server->provider, server->context,
+				   staging, PIPELINE_DEPTH);
+	if (pipeline == NULL) {
+		ERROR("failed to pipeline_create(): %s", pipeline_get_error());
+		goto DESTROY_STAGING;
+	}
+
+	epfd = epoll_create1(0);
+	if (epfd == -1) {
+		ERROR("failed to epoll_create1(): %s", strerror(errno));
+		goto DESTROY_PIPELINE;
+	}
+
+	if (server_watch_listener(server, epfd, EPOLL_CTL_ADD) == -1)
+		goto CLOSE_EPOLL_FD;
+
+	timeout = server_busy_poll_epoll(server, epfd);
+
+	server_begin_stats(server);
+
+	while (atomic_load(&server->running)) {
+		int nevent = epoll_wait(epfd, events, MAX_EVENTS,
+			  		server->nstalled > 0 && timeout
+			  			? STALL_TIMEOUT : timeout);
+		if (nevent == -1) {
+			if (errno == EINTR)
+				continue;
+
+			ERROR("failed to epoll_wait(): %s", strerror(errno));
+			goto CLOSE_CLIENTS;
+		}
+
+		for (int i = 0; i < nevent; i++) {
+			struct connection *conn = events[i].data.ptr;
+			int ret;
+
+			if (conn == NULL)
+				ret = server_accept_client(server, epfd);
+			else
+				ret = server_receive(server, epfd,
+			 			     conn, pipeline);
+
+			if (ret == -1)
+				goto CLOSE_CLIENTS;
+		}
+
+		if (server->ring_mode)
+			if (server_drain_rings(server, epfd) == -1)
+				goto CLOSE_CLIENTS;
+
+		if (server_resume_accepting(server, epfd) == -1)
+			goto CLOSE_CLIENTS;
+
+		server_tick(server, pipeline);
+	}
+
+	// slices are only released once nothing is copied into them
+	if (pipeline_flush(pipeline) == -1) {
+		ERROR("failed to pipeline_flush(): %s", pipeline_get_error());
+		goto CLOSE_CLIENTS;
+	}
+
+	for (int i = 0; i < MAX_CLIENTS; i++)
+		if (server->clients[i].fd != -1)
+			server_close_client(server, epfd, &server->clients[i]);
+
+	close(epfd);
+
+	server_end_stats(server, pipeline);
+
+	pipeline_destroy(pipeline);
+	server_put_staging(server, staging);
+
+	return 0;
+
+CLOSE_CLIENTS:	pipeline_flush(pipeline);
+		for (int i = 0; i < MAX_CLIENTS; i++)
+			if (server->clients[i].fd != -1)
+				server_close_client(server, epfd,
+			    			    &server->clients[i]);
+CLOSE_EPOLL_FD:	close(epfd);
+DESTROY_PIPELINE:
+		pipeline_destroy(pipeline);
+DESTROY_STAGING:
+		server_put_staging(server, staging);
+RETURN_ERROR:	return -1;
+}
+
+struct uring_engine {
+	struct io_uring ring;
+	struct io_uring_buf_ring *buf_ring;
+	char *buffers;
+
+	// accepted before a cancel took effect, waiting for a slice
+	int parked[MAX_CLIENTS];
+	int nparked;
+	bool armed;
+};
+
+static int uring_arm_accept(Server server, struct uring_engine *engine)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&engine->ring);
+	if (sqe == NULL) {
+		ERROR("failed to io_uring_get_sqe(): submission queue is full");
+		return -1;
+	}
+
+	io_uring_prep_multishot_accept(sqe, server->sockfd, NULL, NULL, 0);
+	io_uring_sqe_set_data(sqe, NULL);
+
+	engine->armed = true;
+	server->listening = true;
+
+	return 0;
+}
+
+// The io_uring flavour of server_pause_accepting(): the multishot accept
+// is cancelled and pending clients wait in the backlog.
+static int uring_pause_accept(Server server, struct uring_engine *engine,
+			      bool starved)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&engine->ring);
+	if (sqe == NULL) {
+		ERROR("failed to io_uring_get_sqe(): submission queue is full");
+		return -1;
+	}
+
+	io_uring_prep_cancel(sqe, NULL, 0);
+	io_uring_sqe_set_data(sqe, URING_CANCEL);
+
+	server->listening = false;
+	server->retry_accept = starved
+			     ? stats_now() + EPOLL_TIMEOUT * 1000000ULL : 0;
+
+	return 0;
+}
+
+static int uring_arm_recv(struct uring_engine *engine,
+			  struct connection *conn)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&engine->ring);
+	if (sqe == NULL) {
+		ERROR("failed to io_uring_get_sqe(): submission queue is full");
+		return -1;
+	}
+
+	io_uring_prep_recv_multishot(sqe, conn->fd, NULL, 0, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	io_uring_sqe_set_data(sqe, conn);
+
+	return 0;
+}
+
+static void uring_recycle_buffer(struct uring_engine *engine, int bid)
+{
+	io_uring_buf_ring_add(
+		engine->buf_ring, engine->buffers + bid * URING_BUFFER_SIZE,
+		URING_BUFFER_SIZE, bid,
+		io_uring_buf_ring_mask(URING_BUFFERS), 0
+	);
+	io_uring_buf_ring_advance(engine->buf_ring, 1);
+}
+
+// conn already holds a slice
+static int uring_add_client(Server server, struct uring_engine *engine,
+			    struct connection *conn, int clnt_fd)
+{
+	server_tune_client(server, clnt_fd);
+
+	conn->fd = clnt_fd;
+	conn->recvlen = 0;
+	conn->overflow = false;
+	stats_reset(&conn->stats);
+
+	if (uring_arm_recv(engine, conn) == -1)
+		return -1;
+
+	if (++server->nclient == MAX_CLIENTS && server->listening)
+		return uring_pause_accept(server, engine, false);
+
+	return 0;
+}
+
+// Completions posted before the cancel took effect still carry a
+// client; it is kept until a slot and a slice free up.
+static int uring_park_client(Server server, struct uring_engine *engine,
+			     int clnt_fd, bool starved)
+{
+	// only a burst of more than MAX_CLIENTS connects gets here
+	if (engine->nparked == MAX_CLIENTS) {
+		close(clnt_fd);
+		return 0;
+	}
+
+	engine->parked[engine->nparked++] = clnt_fd;
+
+	if (server->listening)
+		return uring_pause_accept(server, engine, starved);
+
+	if (starved)
+		server->retry_accept = stats_now()
+				     + EPOLL_TIMEOUT * 1000000ULL;
+
+	return 0;
+}
+
+static int uring_handle_accept(Server server, struct uring_engine *engine,
+			       struct io_uring_cqe *cqe)
+{
+	struct connection *conn;
+
+	// re-armed unless cancelled on purpose
+	if ( !(cqe->flags & IORING_CQE_F_MORE) ) {
+		engine->armed = false;
+
+		if (server->listening)
+			if (uring_arm_accept(server, engine) == -1)
+				return -1;
+	}
+
+	if (cqe->res < 0) {
+		if (cqe->res == -EINTR || cqe->res == -ECONNABORTED
+		 || cqe->res == -ECANCELED)
+			return 0;
+
+		ERROR("failed to accept(): %s", strerror(-cqe->res));
+		return -1;
+	}
+
+	conn = server_find_slot(server);
+	if (conn == NULL)
+		return uring_park_client(server, engine, cqe->res, false);
+
+	if (server_assign_slice(server, conn) == -1)
+		return uring_park_client(server, engine, cqe->res, true);
+
+	return uring_add_client(server, engine, conn, cqe->res);
+}
+
+// The io_uring flavour of server_resume_accepting(): parked clients are
+// served first, in the order they came in.
+static int uring_resume_accept(Server server, struct uring_engine *engine)
+{
+	struct connection *conn;
+	int clnt_fd;
+
+	// a cancelled accept is only re-armed once its last completion is in
+	if (server->listening || engine->armed
+	 || stats_now() < server->retry_accept)
+		return 0;
+
+	while (engine->nparked > 0) {
+		conn = server_find_slot(server);
+		if (conn == NULL)
+			return 0;
+
+		if (server_assign_slice(server, conn) == -1) {
+			server->retry_accept = stats_now()
+					     + EPOLL_TIMEOUT * 1000000ULL;
+			return 0;
+		}
+
+		clnt_fd = engine->parked[0];
+		memmove(engine->parked, engine->parked + 1,
+			--engine->nparked * sizeof(*engine->parked));
+
+		if (uring_add_client(server, engine, conn, clnt_fd) == -1)
+			return -1;
+	}
+
+	if (server->nclient == MAX_CLIENTS)
+		return 0;
+
+	return uring_arm_accept(server, engine);
+}
+
+static int uring_handle_recv(Server server, struct uring_engine *engine,
+			     struct io_uring_cqe *cqe)
+{
+	struct connection *conn = io_uring_cqe_get_data(cqe);
+	size_t len;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		uint64_t elapsed;
+		int ret;
+
+		// one completion stands in for one recv() call
+		server_account_recv(server, conn, cqe->res);
+
+		// what does not fit is dropped, and the client flagged
+		len = cqe->res;
+		if (len > server->slice - conn->recvlen) {
+			len = server->slice - conn->recvlen;
+			conn->overflow = true;
+		}
+
+		elapsed = stats_now();
+		ret = server->provider->memcpy_to(
+			server->context, engine->buffers + bid * URING_BUFFER_SIZE,
+			conn->offset + conn->recvlen, len
+		);
+		server_account_copy(server, conn, stats_now() - elapsed);
+
+		uring_recycle_buffer(engine, bid);
+
+		if (ret == -1) {
+			ERROR("failed to provider->memcpy_to(): %s",
+	 		      server->provider->get_error());
+			return -1;
+		}
+
+		conn->recvlen += len;
+
+		// slice is full: the terminating completion closes the fd
+		if (conn->recvlen == server->slice)
+			shutdown(conn->fd, SHUT_RD);
+	}
+
+	if (cqe->flags & IORING_CQE_F_MORE)
+		return 0;
+
+	// multishot ends on errors, EOF and buffer exhaustion
+	if (cqe->res > 0 || cqe->res == -ENOBUFS)
+		return uring_arm_recv(engine, conn);
+
+	server_report_client(server, conn);
+
+	// memcpy_to() above is synchronous: nothing is still being copied
+	// into the slice when it goes back to the arena
+	close(conn->fd);
+	server_release_slice(server, conn);
+	conn->fd = -1;
+	conn->recvlen = 0;
+
+	// a slot and a slice are free again: accept at once
+	server->nclient--;
+	server->retry_accept = 0;
+
+	return 0;
+}
+
+int server_run_as_uring(Server server)
+{
+	struct __kernel_timespec timeout = {
+		.tv_sec = 0, .tv_nsec = EPOLL_TIMEOUT * 1000000LL
+	};
+	struct io_uring_cqe *cqes[URING_ENTRIES];
+	struct uring_engine engine;
+	int ret;
+
+	engine.buffers = mmap(NULL, URING_BUFFERS * URING_BUFFER_SIZE,
+		       	      PROT_READ | PROT_WRITE,
+		       	      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (engine.buffers == MAP_FAILED) {
+		ERROR("failed to mmap(): %s", strerror(errno));
+		goto RETURN_ERROR;
+	}
+
+	ret = io_uring_queue_init(URING_ENTRIES, &engine.ring, 0);
+	if (ret < 0) {
+		ERROR("failed to io_uring_queue_init(): %s", strerror(-ret));
+		goto UNMAP_BUFFERS;
+	}
+
+	engine.buf_ring = io_uring_setup_buf_ring(
+		&engine.ring, URING_BUFFERS, URING_BGID, 0, &ret
+	);
+	if (engine.buf_ring == NULL) {
+		ERROR("failed to io_uring_setup_buf_ring(): %s",
+		      strerror(-ret));
+		goto EXIT_QUEUE;
+	}
+
+	for (int i = 0; i < URING_BUFFERS; i++)
+		io_uring_buf_ring_add(
+			engine.buf_ring, engine.buffers + i * URING_BUFFER_SIZE,
+			URING_BUFFER_SIZE, i,
+			io_uring_buf_ring_mask(URING_BUFFERS), i
+		);
+	io_uring_buf_ring_advance(engine.buf_ring, URING_BUFFERS);
+
+	engine.nparked = 0;
+	engine.armed = false;
+	server->retry_accept = 0;
+	if (uring_arm_accept(server, &engine) == -1)
+		goto FREE_BUF_RING;
+
+	server_begin_stats(server);
+
+	while (atomic_load(&server->running)) {
+		struct io_uring_cqe *cqe;
+		unsigned int ncqe;
+
+		ret = io_uring_submit_and_wait_timeout(
+			&engine.ring, &cqe, 1, &timeout, NULL
+		);
+		if (ret < 0 && ret != -ETIME && ret != -EINTR) {
+			ERROR("failed to io_uring_submit_and_wait_timeout(): "
+	 		      "%s", strerror(-ret));
+			goto CLOSE_CLIENTS;
+		}
+
+		// reap everything that is ready in one go
+		ncqe = io_uring_peek_batch_cqe(&engine.ring, cqes,
+				 	       URING_ENTRIES);
+		for (unsigned int i = 0; i < ncqe; i++) {
+			if (io_uring_cqe_get_data(cqes[i]) == URING_CANCEL)
+				ret = 0;
+			else if (io_uring_cqe_get_data(cqes[i]) == NULL)
+				ret = uring_handle_accept(server, &engine,
+			      				  cqes[i]);
+			else
+				ret = uring_handle_recv(server, &engine,
+			    				cqes[i]);
+
+			if (ret == -1) {
+				io_uring_cq_advance(&engine.ring, ncqe);
+				goto CLOSE_CLIENTS;
+			}
+		}
+
+		io_uring_cq_advance(&engine.ring, ncqe);
+
+		if (uring_resume_accept(server, &engine) == -1)
+			goto CLOSE_CLIENTS;
+
+		server_tick(server, NULL);
+	}
+
+	io_uring_free_buf_ring(&engine.ring, engine.buf_ring,
+			       URING_BUFFERS, URING_BGID);
+	io_uring_queue_exit(&engine.ring);
+
+	for (int i = 0; i < MAX_CLIENTS; i++)
+		if (server->clients[i].fd != -1) {
+			server_report_client(server, &server->clients[i]);
+			close(server->clients[i].fd);
+			server_release_slice(server, &server->clients[i]);
+			server->clients[i].fd = -1;
+		}
+	server->nclient = 0;
+
+	for (int i = 0; i < engine.nparked; i++)
+		close(engine.parked[i]);
+
+	server_end_stats(server, NULL);
+
+	munmap(engine.buffers, URING_BUFFERS * URING_BUFFER_SIZE);
+
+	return 0;
+
+CLOSE_CLIENTS:	for (int i = 0; i < MAX_CLIENTS; i++)
+			if (server->clients[i].fd != -1) {
+				close(server->clients[i].fd);
+				server_release_slice(server,
+			 			     &server->clients[i]);
+				server->clients[i].fd = -1;
+			}
+		server->nclient = 0;
+		for (int i = 0; i < engine.nparked; i++)
+			close(engine.parked[i]);
+FREE_BUF_RING:	io_uring_free_buf_ring(&engine.ring, engine.buf_ring,
+		       		       URING_BUFFERS, URING_BGID);
+EXIT_QUEUE:	io_uring_queue_exit(&engine.ring);
+UNMAP_BUFFERS:	munmap(engine.buffers, URING_BUFFERS * URING_BUFFER_SIZE);
+RETURN_ERROR:	return -1;
+}
+
+void server_stop(Server server)
+{
+	atomic_store(&server->running, false);
+}
+
+void server_cleanup(Server server)
+{
+	for (int i = 0; i < MAX_CLIENTS; i++)
+		ring_destroy(server->clients[i].ring);
+
+	if ( !server->shared_arena )
+		arena_destroy(server->arena);
+
+	if (server->devmem != NULL)
+		devmem_unbind(server->devmem);
+
 	free(server);
 }
 
@@ -3,18 +3,22 @@
 #include <stdio.h>		// sprintf(), BUFSIZ
 #include <string.h>		// memset(), strerror()
 #include <errno.h>		// errno
+#include <limits.h>		// INT_MAX
+#include <stdint.h>		// uint64_t
 
 #include <unistd.h>		// close()
 
 #include <sys/socket.h>		// socket(), bind(), setsockopt() ...
 #include <arpa/inet.h>		// struct sockaddr_in
+#include <netinet/in.h>		// IPPROTO_TCP
+#include <netinet/tcp.h>	// TCP_NODELAY, TCP_INFO, struct tcp_info
 
 #define ERROR(...) do {				\
 	snprintf(error, BUFSIZ, __VA_ARGS__);	\
 	return -1;				\
 } while (false)
 
-static char error[BUFSIZ];
+static __thread char error[BUFSIZ];
 
 static int socket_reuseaddr(int fd)
 {
@@ -59,6 +63,179 @@ int socket_create(char *address, int port)
 	return sockfd;
 }
 
+static int socket_setopt(int fd, int level, int name, int value,
+			 const char *optname)
+{
+	if (setsockopt(fd, level, name, &value, sizeof(value)) == -1)
+		ERROR("failed to setsockopt(%s): %s", optname, strerror(errno));
+
+	return 0;
+}
+
+int socket_tune(int sockfd, struct socket_profile *profile)
+{
+	int ret;
+
+	if (profile->rcvbuf > 0) {
+		ret = socket_setopt(sockfd, SOL_SOCKET, SO_RCVBUF,
+		      		    profile->rcvbuf, "SO_RCVBUF");
+		if (ret == -1)
+			return -1;
+	}
+
+	if (profile->sndbuf > 0) {
+		ret = socket_setopt(sockfd, SOL_SOCKET, SO_SNDBUF,
+		      		    profile->sndbuf, "SO_SNDBUF");
+		if (ret == -1)
+			return -1;
+	}
+
+	if (profile->rcvlowat > 0) {
+		ret = socket_setopt(sockfd, SOL_SOCKET, SO_RCVLOWAT,
+		      		    profile->rcvlowat, "SO_RCVLOWAT");
+		if (ret == -1)
+			return -1;
+	}
+
+	if (profile->notsent_lowat > 0) {
+		ret = socket_setopt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+		      		    profile->notsent_lowat, "TCP_NOTSENT_LOWAT");
+		if (ret == -1)
+			return -1;
+	}
+
+	if (profile->nodelay) {
+		ret = socket_setopt(sockfd, IPPROTO_TCP, TCP_NODELAY,
+		      		    1, "TCP_NODELAY");
+		if (ret == -1)
+			return -1;
+	}
+
+	if (profile->busy_poll > 0) {
+		ret = socket_setopt(sockfd, SOL_SOCKET, SO_BUSY_POLL,
+		      		    profile->busy_poll, "SO_BUSY_POLL");
+		if (ret == -1)
+			return -1;
+
+		ret = socket_setopt(sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+		      		    1, "SO_PREFER_BUSY_POLL");
+		if (ret == -1)
+			return -1;
+	}
+
+	if (profile->busy_poll_budget > 0) {
+		ret = socket_setopt(sockfd, SOL_SOCKET, SO_BUSY_POLL_BUDGET,
+		      		    profile->busy_poll_budget,
+		      		    "SO_BUSY_POLL_BUDGET");
+		if (ret == -1)
+			return -1;
+	}
+
+	if (profile->congestion != NULL) {
+		ret = setsockopt(sockfd, IPPROTO_TCP, TCP_CONGESTION,
+		   		 profile->congestion,
+		   		 strlen(profile->congestion));
+		if (ret == -1)
+			ERROR("failed to setsockopt(TCP_CONGESTION, %s): %s",
+			      profile->congestion, strerror(errno));
+	}
+
+	return 0;
+}
+
+// One field of a sysctl such as tcp_rmem, or -1 if it cannot be read.
+static long long socket_read_sysctl(const char *path, int field)
+{
+	long long values[3];
+	FILE *file;
+	int n;
+
+	file = fopen(path, "r");
+	if (file == NULL)
+		return -1;
+
+	n = fscanf(file, "%lld %lld %lld", &values[0], &values[1], &values[2]);
+	fclose(file);
+
+	return n > field ? values[field] : -1;
+}
+
+// A buffer set by hand is locked at that size and no longer autotuned,
+// so it is only set when it ends up larger than the most autotuning
+// would grow it to (the third field of tcp_rmem/tcp_wmem).
+static int socket_raise_buffer(int sockfd, int name, const char *optname,
+			       long long size, const char *tcp_mem,
+			       const char *core_max)
+{
+	long long autotune_max;
+	long long limit;
+
+	autotune_max = socket_read_sysctl(tcp_mem, 2);
+	if (autotune_max == -1)
+		return 0;
+
+	// setsockopt() clamps to net.core.*mem_max and then doubles
+	limit = socket_read_sysctl(core_max, 0);
+	if (limit != -1 && size > limit)
+		size = limit;
+
+	if (size * 2 <= autotune_max)
+		return 0;
+
+	return socket_setopt(sockfd, SOL_SOCKET, name, size, optname);
+}
+
+// Needs a connected socket: the RTT comes from the handshake. The
+// bandwidth is the configured one, not measured.
+int socket_autotune(int sockfd, struct socket_profile *profile)
+{
+	struct tcp_info info;
+	socklen_t len;
+	long long bandwidth;
+	long long bdp;
+	int ret;
+
+	if ( !profile->autotune )
+		return 0;
+
+	len = sizeof(info);
+	if (getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1)
+		ERROR("failed to getsockopt(TCP_INFO): %s", strerror(errno));
+
+	bandwidth = profile->bandwidth;
+	if (bandwidth <= 0)
+		bandwidth = SOCKET_DEFAULT_BANDWIDTH;
+
+	// bytes in flight over one RTT, doubled for the kernel's overhead
+	bdp = bandwidth / 8 * info.tcpi_rtt / 1000000 * 2;
+	if (bdp > INT_MAX / 2)	// the kernel doubles whatever we set
+		bdp = INT_MAX / 2;
+
+	ret = socket_raise_buffer(sockfd, SO_RCVBUF, "SO_RCVBUF", bdp,
+				  "/proc/sys/net/ipv4/tcp_rmem",
+				  "/proc/sys/net/core/rmem_max");
+	if (ret == -1)
+		return -1;
+
+	return socket_raise_buffer(sockfd, SO_SNDBUF, "SO_SNDBUF", bdp,
+				   "/proc/sys/net/ipv4/tcp_wmem",
+				   "/proc/sys/net/core/wmem_max");
+}
+
+// Has the kernel space out the packets of this socket; TCP paces on its
+// own since Linux 4.13, before that only under the fq qdisc.
+int socket_set_pacing(int sockfd, long long rate)
+{
+	uint64_t bytes = rate / 8;
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_MAX_PACING_RATE,
+		&bytes, sizeof(bytes)) == -1)
+		ERROR("failed to setsockopt(SO_MAX_PACING_RATE): %s",
+		      strerror(errno));
+
+	return 0;
+}
+
 char *socket_get_error(void)
 {
 	return error;
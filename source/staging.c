@@ -0,0 +1,158 @@
+#include "staging.h"
+
+#include <stdio.h>	// BUFSIZ
+#include <stdbool.h>	// true, false
+#include <stdlib.h>	// malloc()
+#include <string.h>	// strerror()
+#include <errno.h>	// errno
+
+#include <pthread.h>	// pthread_mutex_*(), pthread_cond_*()
+#include <sys/mman.h>	// mmap(), madvise(), MAP_HUGETLB
+
+#define HUGEPAGE_SIZE	(2 * 1024 * 1024)
+
+#define ERROR(...) do {					\
+	snprintf(error, BUFSIZ, __VA_ARGS__);		\
+} while(false)
+
+// A fixed set of equally sized chunks carved out of one mapping. Callers
+// block in staging_get() while every chunk is handed out, which bounds
+// the host memory used for staging no matter how many users share it.
+struct staging_pool {
+	char *mapping;
+	size_t length;
+
+	size_t chunk_size;
+	int nchunk;
+
+	int nfree;
+	void **free_chunks;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static __thread char error[BUFSIZ];
+
+static void *staging_map(size_t length)
+{
+	void *mapping;
+
+	mapping = mmap(NULL, length, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (mapping != MAP_FAILED)
+		return mapping;
+
+	// no reserved hugepages: fall back to transparent ones
+	mapping = mmap(NULL, length, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapping == MAP_FAILED)
+		return NULL;
+
+	madvise(mapping, length, MADV_HUGEPAGE);
+
+	return mapping;
+}
+
+StagingPool staging_create(int nchunk, size_t chunk_size)
+{
+	StagingPool pool;
+
+	if (nchunk <= 0 || chunk_size == 0) {
+		ERROR("invalid staging pool geometry: %d x %zu",
+		      nchunk, chunk_size);
+		goto RETURN_NULL;
+	}
+
+	pool = malloc(sizeof(struct staging_pool));
+	if (pool == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto RETURN_NULL;
+	}
+
+	pool->free_chunks = malloc(sizeof(void *) * nchunk);
+	if (pool->free_chunks == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto FREE_POOL;
+	}
+
+	pool->length = chunk_size * nchunk;
+	pool->length = (pool->length + HUGEPAGE_SIZE - 1)
+		     & ~((size_t) HUGEPAGE_SIZE - 1);
+
+	pool->mapping = staging_map(pool->length);
+	if (pool->mapping == NULL) {
+		ERROR("failed to mmap(): %s", strerror(errno));
+		goto FREE_CHUNKS;
+	}
+
+	pool->chunk_size = chunk_size;
+	pool->nchunk = nchunk;
+
+	for (int i = 0; i < nchunk; i++)
+		pool->free_chunks[i] = pool->mapping + chunk_size * i;
+	pool->nfree = nchunk;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	return pool;
+
+FREE_CHUNKS:	free(pool->free_chunks);
+FREE_POOL:	free(pool);
+RETURN_NULL:	return NULL;
+}
+
+void *staging_get(StagingPool pool)
+{
+	void *chunk;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->nfree == 0)
+		pthread_cond_wait(&pool->cond, &pool->lock);
+
+	chunk = pool->free_chunks[--pool->nfree];
+	pthread_mutex_unlock(&pool->lock);
+
+	return chunk;
+}
+
+void staging_put(StagingPool pool, void *chunk)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->free_chunks[pool->nfree++] = chunk;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+size_t staging_get_chunk_size(StagingPool pool)
+{
+	return pool->chunk_size;
+}
+
+int staging_get_nchunk(StagingPool pool)
+{
+	return pool->nchunk;
+}
+
+void *staging_get_region(StagingPool pool, size_t *length)
+{
+	*length = pool->length;
+	return pool->mapping;
+}
+
+void staging_destroy(StagingPool pool)
+{
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+
+	munmap(pool->mapping, pool->length);
+
+	free(pool->free_chunks);
+	free(pool);
+}
+
+char *staging_get_error(void)
+{
+	return error;
+}
@@ -0,0 +1,176 @@
+#include "stats.h"
+
+#include <stdio.h>	// snprintf()
+#include <string.h>	// memset()
+
+#include <time.h>	// clock_gettime()
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int histogram_index(uint64_t value)
+{
+	int shift;
+
+	if (value < HISTOGRAM_SUBBUCKETS)
+		return value;
+
+	// keep the top HISTOGRAM_SUBBITS + 1 bits of the value
+	shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUBBITS;
+
+	return (shift + 1) * HISTOGRAM_SUBBUCKETS
+	     + (value >> shift) - HISTOGRAM_SUBBUCKETS;
+}
+
+static uint64_t histogram_value(int index)
+{
+	int shift = index / HISTOGRAM_SUBBUCKETS;
+
+	if (shift == 0)
+		return index;
+
+	return (uint64_t) (index % HISTOGRAM_SUBBUCKETS
+			 + HISTOGRAM_SUBBUCKETS) << (shift - 1);
+}
+
+void histogram_reset(struct histogram *histogram)
+{
+	memset(histogram, 0x00, sizeof(struct histogram));
+}
+
+void histogram_record(struct histogram *histogram, uint64_t value)
+{
+	histogram->buckets[histogram_index(value)]++;
+
+	histogram->count++;
+	histogram->sum += value;
+	if (value > histogram->max)
+		histogram->max = value;
+}
+
+void histogram_merge(struct histogram *dst, const struct histogram *src)
+{
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+uint64_t histogram_percentile(const struct histogram *histogram,
+			      double percentile)
+{
+	uint64_t target, seen;
+
+	if (histogram->count == 0)
+		return 0;
+
+	target = histogram->count * percentile / 100.0;
+	if (target >= histogram->count)
+		target = histogram->count - 1;
+
+	seen = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if (seen > target) {
+			uint64_t value = histogram_value(i);
+			return value < histogram->max ? value : histogram->max;
+		}
+	}
+
+	return histogram->max;
+}
+
+void stats_reset(struct stats *stats)
+{
+	memset(stats, 0x00, sizeof(struct stats));
+	stats->start_ns = stats->end_ns = stats_now();
+}
+
+void stats_record_recv(struct stats *stats, ssize_t len)
+{
+	stats->calls++;
+
+	if (len <= 0)
+		return;
+
+	stats->bytes += len;
+	stats->chunks++;
+	if (len > stats->max_chunk)
+		stats->max_chunk = len;
+}
+
+void stats_record_copy(struct stats *stats, uint64_t nanoseconds)
+{
+	histogram_record(&stats->copy_ns, nanoseconds);
+}
+
+void stats_merge(struct stats *dst, const struct stats *src)
+{
+	if (src->start_ns < dst->start_ns)
+		dst->start_ns = src->start_ns;
+	if (src->end_ns > dst->end_ns)
+		dst->end_ns = src->end_ns;
+
+	dst->bytes += src->bytes;
+	dst->calls += src->calls;
+	dst->chunks += src->chunks;
+	if (src->max_chunk > dst->max_chunk)
+		dst->max_chunk = src->max_chunk;
+
+	histogram_merge(&dst->copy_ns, &src->copy_ns);
+}
+
+int histogram_describe(const struct histogram *histogram,
+		       char *buffer, size_t size)
+{
+	return snprintf(
+		buffer, size,
+		"%lu samples, avg %lu ns p50 %lu ns p99 %lu ns "
+		"p99.9 %lu ns max %lu ns",
+		histogram->count,
+		histogram->count ? histogram->sum / histogram->count : 0,
+		histogram_percentile(histogram, 50),
+		histogram_percentile(histogram, 99),
+		histogram_percentile(histogram, 99.9),
+		histogram->max
+	);
+}
+
+int stats_describe(const struct stats *stats, char *buffer, size_t size)
+{
+	double seconds = (stats->end_ns - stats->start_ns) / 1e9;
+	int len;
+
+	len = snprintf(
+		buffer, size,
+		"%zu bytes in %.3f s (%.3f Gbit/s), "
+		"%zu recv calls, chunk avg %zu max %zu",
+		stats->bytes, seconds,
+		seconds > 0 ? stats->bytes * 8 / seconds / 1e9 : 0.0,
+		stats->calls,
+		stats->chunks ? stats->bytes / stats->chunks : 0,
+		stats->max_chunk
+	);
+
+	// copies timed elsewhere (e.g. by a pipeline) leave this empty
+	if (stats->copy_ns.count == 0 || len < 0 || len >= size)
+		return len;
+
+	return len + snprintf(
+		buffer + len, size - len,
+		", memcpy_to %lu calls p50 %lu ns p99 %lu ns max %lu ns",
+		stats->copy_ns.count,
+		histogram_percentile(&stats->copy_ns, 50),
+		histogram_percentile(&stats->copy_ns, 99),
+		stats->copy_ns.max
+	);
+}
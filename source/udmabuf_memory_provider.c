@@ -0,0 +1,251 @@
+#define _GNU_SOURCE
+
+#include "udmabuf_memory_provider.h"
+
+#include <stdio.h>	// BUFSIZ
+#include <stdbool.h>	// true, false
+#include <stdlib.h>	// malloc()
+#include <string.h>	// memcpy(), strerror()
+#include <errno.h>	// errno
+
+#include <unistd.h>	// ftruncate(), sysconf(), close()
+#include <fcntl.h>	// open(), fcntl(), F_ADD_SEALS
+#include <sys/mman.h>	// memfd_create(), mmap()
+#include <sys/ioctl.h>	// ioctl()
+
+#include <linux/udmabuf.h>	// UDMABUF_CREATE
+#include <linux/dma-buf.h>	// DMA_BUF_IOCTL_SYNC
+
+#define UDMABUF_DEVICE	"/dev/udmabuf"
+
+#define ERROR(...) do {					\
+	snprintf(error, BUFSIZ, __VA_ARGS__);		\
+} while(false)
+
+// Mirrors ncdevmem's struct memory_buffer: the dmabuf is fd, the bytes
+// of the caller are [offset, offset + size) of it.
+struct memory {
+	int fd;
+	size_t offset;
+	size_t size;
+
+	int devfd;
+	int memfd;
+	char *buf_mem;
+	size_t length;
+};
+
+static __thread char error[BUFSIZ];
+
+static Memory udmabuf_alloc(size_t size)
+{
+	struct udmabuf_create create;
+	Memory memory;
+	long page_size;
+
+	if (size == 0) {
+		ERROR("invalid size: %zu", size);
+		goto RETURN_NULL;
+	}
+
+	memory = malloc(sizeof(struct memory));
+	if (memory == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto RETURN_NULL;
+	}
+
+	// udmabuf only takes whole pages
+	page_size = sysconf(_SC_PAGESIZE);
+	memory->offset = 0;
+	memory->size = size;
+	memory->length = (size + page_size - 1) & ~((size_t) page_size - 1);
+
+	memory->devfd = open(UDMABUF_DEVICE, O_RDWR);
+	if (memory->devfd == -1) {
+		ERROR("failed to open(%s): %s", UDMABUF_DEVICE, strerror(errno));
+		goto FREE_MEMORY;
+	}
+
+	memory->memfd = memfd_create("udmabuf", MFD_ALLOW_SEALING);
+	if (memory->memfd == -1) {
+		ERROR("failed to memfd_create(): %s", strerror(errno));
+		goto CLOSE_DEVFD;
+	}
+
+	if (ftruncate(memory->memfd, memory->length) == -1) {
+		ERROR("failed to ftruncate(): %s", strerror(errno));
+		goto CLOSE_MEMFD;
+	}
+
+	// the pages handed to the dmabuf must never go away
+	if (fcntl(memory->memfd, F_ADD_SEALS, F_SEAL_SHRINK) == -1) {
+		ERROR("failed to fcntl(F_ADD_SEALS): %s", strerror(errno));
+		goto CLOSE_MEMFD;
+	}
+
+	create.memfd = memory->memfd;
+	create.flags = UDMABUF_FLAGS_CLOEXEC;
+	create.offset = 0;
+	create.size = memory->length;
+
+	memory->fd = ioctl(memory->devfd, UDMABUF_CREATE, &create);
+	if (memory->fd == -1) {
+		ERROR("failed to ioctl(UDMABUF_CREATE): %s", strerror(errno));
+		goto CLOSE_MEMFD;
+	}
+
+	memory->buf_mem = mmap(NULL, memory->length, PROT_READ | PROT_WRITE,
+			       MAP_SHARED, memory->memfd, 0);
+	if (memory->buf_mem == MAP_FAILED) {
+		ERROR("failed to mmap(): %s", strerror(errno));
+		goto CLOSE_FD;
+	}
+
+	return memory;
+
+CLOSE_FD:	close(memory->fd);
+CLOSE_MEMFD:	close(memory->memfd);
+CLOSE_DEVFD:	close(memory->devfd);
+FREE_MEMORY:	free(memory);
+RETURN_NULL:	return NULL;
+}
+
+static int udmabuf_free(Memory memory)
+{
+	if (munmap(memory->buf_mem, memory->length) == -1) {
+		ERROR("failed to munmap(): %s", strerror(errno));
+		return -1;
+	}
+
+	close(memory->fd);
+	close(memory->memfd);
+	close(memory->devfd);
+
+	free(memory);
+
+	return 0;
+}
+
+static size_t udmabuf_get_size(Memory memory)
+{
+	return memory->size;
+}
+
+static int udmabuf_check_range(Memory memory, size_t offset, size_t len)
+{
+	if (offset > memory->size || len > memory->size - offset) {
+		ERROR("out of range: %zu + %zu > %zu",
+		      offset, len, memory->size);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int udmabuf_sync(Memory memory, __u64 flags)
+{
+	struct dma_buf_sync sync = { .flags = flags };
+
+	if (ioctl(memory->fd, DMA_BUF_IOCTL_SYNC, &sync) == -1) {
+		ERROR("failed to ioctl(DMA_BUF_IOCTL_SYNC): %s",
+		      strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int udmabuf_memcpy_to(Memory memory, void *src,
+			     size_t offset, size_t len)
+{
+	if (udmabuf_check_range(memory, offset, len) == -1)
+		return -1;
+
+	if (udmabuf_sync(memory, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE))
+		return -1;
+
+	memcpy(memory->buf_mem + memory->offset + offset, src, len);
+
+	if (udmabuf_sync(memory, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE))
+		return -1;
+
+	return len;
+}
+
+static int udmabuf_memcpy_from(void *dst, Memory memory,
+			       size_t offset, size_t len)
+{
+	if (udmabuf_check_range(memory, offset, len) == -1)
+		return -1;
+
+	if (udmabuf_sync(memory, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ))
+		return -1;
+
+	memcpy(dst, memory->buf_mem + memory->offset + offset, len);
+
+	if (udmabuf_sync(memory, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ))
+		return -1;
+
+	return len;
+}
+
+int udmabuf_memory_memcpy_to_v(Memory memory, const struct memory_vec *vec,
+			       int count)
+{
+	for (int i = 0; i < count; i++)
+		if (udmabuf_check_range(memory, vec[i].offset,
+			  		vec[i].len) == -1)
+			return -1;
+
+	if (udmabuf_sync(memory, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE))
+		return -1;
+
+	for (int i = 0; i < count; i++)
+		memcpy(memory->buf_mem + memory->offset + vec[i].offset,
+		       vec[i].ptr, vec[i].len);
+
+	return udmabuf_sync(memory, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+}
+
+int udmabuf_memory_memcpy_from_v(Memory memory, const struct memory_vec *vec,
+				 int count)
+{
+	for (int i = 0; i < count; i++)
+		if (udmabuf_check_range(memory, vec[i].offset,
+			  		vec[i].len) == -1)
+			return -1;
+
+	if (udmabuf_sync(memory, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ))
+		return -1;
+
+	for (int i = 0; i < count; i++)
+		memcpy(vec[i].ptr,
+		       memory->buf_mem + memory->offset + vec[i].offset,
+		       vec[i].len);
+
+	return udmabuf_sync(memory, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+}
+
+static char *udmabuf_get_error(void)
+{
+	return error;
+}
+
+int udmabuf_memory_get_fd(Memory memory)
+{
+	return memory->fd;
+}
+
+size_t udmabuf_memory_get_offset(Memory memory)
+{
+	return memory->offset;
+}
+
+struct memory_provider udmabuf_memory_provider = {
+	.alloc = udmabuf_alloc,
+	.free = udmabuf_free,
+	.get_size = udmabuf_get_size,
+	.memcpy_to = udmabuf_memcpy_to,
+	.memcpy_from = udmabuf_memcpy_from,
+	.get_error = udmabuf_get_error
+};